@@ -0,0 +1,204 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Microbenchmarks of the building blocks of sparsenn.        *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "dataset.h"
+#include "kernels.h"
+#include "metrics.h"
+#include "nnet.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Every benchmark repeats its work until it has run this long */
+static double mintime=1.0;
+
+static double now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec+1e-9*t.tv_nsec;
+}
+
+/* Prints one result as a line of key=value pairs. The keys and
+ * their order do not change, so the output can be compared from
+ * run to run with simple tools. Rates that do not apply are 0.
+ */
+static void result(const char* name, int hidden, const char* precision, double seconds, double examples, double nonzeros, double bytes){
+    printf("bench=%s kernel=%s precision=%s hidden=%d seconds=%.4f examples_per_sec=%.0f nnz_per_sec=%.0f gb_per_sec=%.3f\n",
+        name, kernelname(), precision, hidden, seconds, examples/seconds, nonzeros/seconds, bytes/seconds*1e-9);
+    fflush(stdout);
+}
+
+static double filesize(const char* name){
+    struct stat st;
+    return stat(name,&st)==0 ? (double)st.st_size : 0.0;
+}
+
+static void benchload(const char* name){
+    dataset_t d;
+    double t,examples=0,nonzeros=0,bytes=0;
+    int i;
+    t=now();
+    do{
+        loadData(name,&d);
+        examples+=d.nex;
+        for(i=0; i<d.nex; i++)
+            nonzeros+=d.example[i].nz;
+        bytes+=filesize(name);
+        freeData(&d);
+    }while(now()-t<mintime);
+    result("loadData",0,"none",now()-t,examples,nonzeros,bytes);
+}
+
+/* Runs train() or value() over the examples in order. The bytes
+ * are the rows of W1 the examples touch: read once by value(),
+ * and read, then read and written again by train().
+ */
+static void benchexamples(nnet_t* n, dataset_t* d, int training, float* p, const char* precision){
+    scratch_t s;
+    double t,examples=0,nonzeros=0;
+    double rowbytes=n->hidden*(n->precision==PRECISION_BF16 ? 2.0 : 4.0);
+    int i=0;
+
+    createscratch(n,&s);
+    t=now();
+    do{
+        if(training)
+            train(n,&s,&d->example[i],d->target[i]);
+        else
+            p[i]=value(n,&s,&d->example[i]);
+        examples+=1;
+        nonzeros+=d->example[i].nz;
+        if(++i==d->nex)
+            i=0;
+    }while((i&1023)!=0 || now()-t<mintime);
+    t=now()-t;
+    destroyscratch(&s);
+    result(training ? "train" : "value",n->hidden,precision,t,examples,nonzeros,nonzeros*rowbytes*(training ? 3 : 1));
+}
+
+/* activation() on the hidden layers of a batch of 256 examples */
+static void benchactivation(int hidden){
+    float *x,*f,*g;
+    double t,values=0;
+    int i,len=256*hidden;
+
+    x=malloc(sizeof(float)*len);
+    f=malloc(sizeof(float)*len);
+    g=malloc(sizeof(float)*len);
+    for(i=0; i<len; i++)
+        x[i]=24.0f*rand()/RAND_MAX-12.0f;
+    t=now();
+    do{
+        activation(x,f,g,len);
+        values+=len;
+    }while(now()-t<mintime);
+    t=now()-t;
+    result("activation",hidden,"float",t,values,0,values*3*sizeof(float));
+    free(x);
+    free(f);
+    free(g);
+}
+
+static void benchsave(nnet_t* n, const char* precision){
+    nnet_t m;
+    char name[64];
+    double t,bytes=0;
+
+    sprintf(name,"nnbench.tmp%d",(int)getpid());
+    t=now();
+    do{
+        savenet(name,n);
+        bytes+=filesize(name);
+    }while(now()-t<mintime);
+    result("savenet",n->hidden,precision,now()-t,0,0,bytes);
+    bytes=0;
+    t=now();
+    do{
+        loadnet(name,&m);
+        bytes+=filesize(name);
+        destroynet(&m);
+    }while(now()-t<mintime);
+    result("loadnet",n->hidden,precision,now()-t,0,0,bytes);
+    unlink(name);
+}
+
+static void benchauc(float* p, int* target, int len, int bits){
+    evaluator_t e;
+    metrics_t m;
+    double t,examples=0;
+
+    initevaluator(&e,bits);
+    t=now();
+    do{
+        evaluate(&e,p,target,len,&m);
+        examples+=len;
+    }while(now()-t<mintime);
+    result(bits ? "auc_histogram" : "auc",0,"none",now()-t,examples,0,0);
+    destroyevaluator(&e);
+}
+
+int main(int argc, char* argv[]){
+    nnet_t n;
+    dataset_t d;
+    char* sizes="16,64,256,1024";
+    char *list,*tok;
+    float* p;
+    int half=0;
+    int hidden;
+    int option;
+    const char* precision;
+
+    const char* help="Usage: %s [options] data\nAvailable options:\n\
+            -h <list> : comma separated numbers of hidden units (default: 16,64,256,1024)\n\
+            -q        : also run the network benchmarks with bfloat16 weights\n\
+            -T <float>: minimum seconds per benchmark (default: 1)\n";
+
+    while((option=getopt(argc,argv,"h:qT:"))!=EOF){
+        switch(option){
+            case 'h': sizes=optarg; break;
+            case 'q': half=1; break;
+            case 'T': mintime=atof(optarg); break;
+            case '?': fprintf(stderr,help,argv[0]); exit(1); break;
+        }
+    }
+    if(argv[optind]==0){
+        fprintf(stderr,help,argv[0]);
+        exit(1);
+    }
+
+    srand(1);
+    benchload(argv[optind]);
+    loadData(argv[optind],&d);
+    p=malloc(sizeof(float)*d.nex);
+    list=strdup(sizes);
+    for(tok=strtok(list,","); tok!=NULL; tok=strtok(NULL,",")){
+        hidden=atoi(tok);
+        if(hidden<1)
+            continue;
+        benchactivation(hidden);
+        for(precision="float"; precision!=NULL; precision = half && strcmp(precision,"float")==0 ? "bf16" : NULL){
+            createnet(&n,&d,hidden,0.01f/d.nex);
+            if(strcmp(precision,"bf16")==0)
+                quantizenet(&n,PRECISION_BF16);
+            benchexamples(&n,&d,1,p,precision);
+            benchexamples(&n,&d,0,p,precision);
+            benchsave(&n,precision);
+            destroynet(&n);
+        }
+    }
+    benchauc(p,d.target,d.nex,0);
+    benchauc(p,d.target,d.nex,16);
+    free(list);
+    free(p);
+    freeData(&d);
+    return 0;
+}
@@ -9,6 +9,7 @@
 #include "dataset.h"
 #include "metrics.h"
 #include "nnet.h"
+#include "server.h"
 #include <getopt.h>
 #include <time.h>
 #include <stdio.h>
@@ -19,32 +20,50 @@ int main(int argc, char* argv[]){
     dataset_t test;
     float *pt;
     int option;
+    int threads=1;
+    int maxbatch=64;
+    char* address=NULL;
     int i;
     FILE* fp;
 
-    const char* help="Usage: %s testset model predictions\n";
+    const char* help="Usage: %s [options] testset model predictions\n\
+       %s -S address [options] model\nAvailable options:\n\
+            -B <int>  : with -S, score at most so many queued examples at once (default: 64)\n\
+            -S <addr> : serve requests at unix:path or host:port instead of scoring a file\n\
+            -t <int>  : number of threads (default: 1)\n";
 
-    while((option=getopt(argc,argv,""))!=EOF){
+    while((option=getopt(argc,argv,"B:S:t:"))!=EOF){
         switch(option){
-            case '?': fprintf(stderr,help,argv[0]); exit(1); break;
+            case 'B': maxbatch=atoi(optarg); break;
+            case 'S': address=optarg; break;
+            case 't': threads=atoi(optarg); break;
+            case '?': fprintf(stderr,help,argv[0],argv[0]); exit(1); break;
         }
     }
 
+    if(address!=NULL){
+        if(argv[optind]==0 || maxbatch<1 || threads<1){
+            fprintf(stderr,help,argv[0],argv[0]);
+            exit(1);
+        }
+        serve(address, argv[optind], threads, maxbatch);
+    }
     if(argv[optind]==0 || argv[optind+1]==0 || argv[optind+2]==0){
-        fprintf(stderr,help,argv[0]);
+        fprintf(stderr,help,argv[0],argv[0]);
         exit(1);
     }
 
     loadData(argv[optind], &test);
-    loadnet(argv[optind+1], &n);
+    mapnet(argv[optind+1], &n);
     fp=fopen(argv[optind+2],"w");
     if(fp==NULL){
         fprintf(stderr,"Could not open output file: %s\n",argv[optind+2]);
         exit(1);
     }
-    clipvectors(n.inputs, test.example, test.nex);
+    writableData(&test);
+    prepvectors(&n, test.example, test.nex);
     pt=malloc(sizeof(float)*test.nex);
-    testnet(&n, &test, pt);
+    testnet(&n, &test, pt, threads);
 
     for(i=0; i<test.nex; i++){
         fprintf(fp,"%f\n",pt[i]);
@@ -0,0 +1,210 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Training with several processes. The processes train on   *
+ *              their own shards of the data and average their weights    *
+ *              through rank 0 over TCP or Unix domain sockets.           *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "cluster.h"
+#include "sockets.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Reductions go through rank 0 in pieces of this many floats,
+ * so its buffer stays small whatever the size of the network.
+ */
+#define CLUSTER_CHUNK 65536
+
+/* How long the other ranks keep trying to reach rank 0 */
+#define CLUSTER_RETRIES 600
+#define CLUSTER_RETRY_USEC 100000
+
+static void sendall(int fd, const void* p, size_t len){
+    const char* s=p;
+    ssize_t r;
+    while(len>0){
+        r=send(fd,s,len,MSG_NOSIGNAL);
+        if(r<0 && errno==EINTR)
+            continue;
+        if(r<=0){
+            perror("Lost connection to another process");
+            exit(1);
+        }
+        s+=r;
+        len-=r;
+    }
+}
+
+static void recvall(int fd, void* p, size_t len){
+    char* s=p;
+    ssize_t r;
+    while(len>0){
+        r=recv(fd,s,len,0);
+        if(r<0 && errno==EINTR)
+            continue;
+        if(r<=0){
+            fprintf(stderr,"Lost connection to another process\n");
+            exit(1);
+        }
+        s+=r;
+        len-=r;
+    }
+}
+
+/* Rank 0 waits for every other rank to connect */
+static void accepting(cluster_t* c, const char* address){
+    int s,fd,i;
+    int32_t rank;
+
+    s=listensocket(address,c->size);
+    if(s<0)
+        exit(1);
+    for(i=1; i<c->size; i++)
+        c->fd[i]=-1;
+    for(i=1; i<c->size; i++){
+        fd=accept(s,NULL,NULL);
+        if(fd<0){
+            perror(address);
+            exit(1);
+        }
+        recvall(fd,&rank,sizeof(rank));
+        if(rank<1 || rank>=c->size || c->fd[rank]!=-1){
+            fprintf(stderr,"Unexpected process with rank %d\n",(int)rank);
+            exit(1);
+        }
+        nodelay(fd);
+        c->fd[rank]=fd;
+    }
+    close(s);
+    if(strncmp(address,"unix:",5)==0)
+        unlink(address+5);
+}
+
+/* The other ranks connect to rank 0, which may not be up yet */
+static void connecting(cluster_t* c, const char* address){
+    int32_t rank=c->rank;
+    int fd,i;
+
+    for(i=0; (fd=connectsocket(address))<0; i++){
+        if(i==CLUSTER_RETRIES){
+            fprintf(stderr,"Could not connect to %s\n",address);
+            exit(1);
+        }
+        usleep(CLUSTER_RETRY_USEC);
+    }
+    sendall(fd,&rank,sizeof(rank));
+    c->fd[0]=fd;
+}
+
+/* Makes this process rank rank of size processes that meet at
+ * address, which is unix:path or host:port. Rank 0 listens
+ * there and returns once all the others have connected.
+ */
+void joincluster(cluster_t* c, const char* address, int rank, int size){
+    c->rank=rank;
+    c->size=size;
+    c->fd=malloc(sizeof(int)*size);
+    c->buf=malloc(sizeof(float)*CLUSTER_CHUNK);
+    if(rank==0)
+        accepting(c,address);
+    else
+        connecting(c,address);
+}
+
+void leavecluster(cluster_t* c){
+    int i;
+    if(c->rank==0){
+        for(i=1; i<c->size; i++)
+            close(c->fd[i]);
+    }
+    else
+        close(c->fd[0]);
+    free(c->fd);
+    free(c->buf);
+}
+
+/* Copies the len values of v on rank 0 to every rank */
+void broadcast(cluster_t* c, float* v, size_t len){
+    int i;
+    if(c->rank!=0){
+        recvall(c->fd[0],v,sizeof(float)*len);
+        return;
+    }
+    for(i=1; i<c->size; i++)
+        sendall(c->fd[i],v,sizeof(float)*len);
+}
+
+/* Replaces v on every rank by the average of v over all ranks.
+ * Rank 0 collects and sums the vectors a piece at a time and
+ * sends the averages back.
+ */
+void allreduce(cluster_t* c, float* v, size_t len){
+    size_t begin,count,j;
+    float scale=1.0f/c->size;
+    int i;
+
+    for(begin=0; begin<len; begin+=count){
+        count = len-begin<CLUSTER_CHUNK ? len-begin : CLUSTER_CHUNK;
+        if(c->rank!=0){
+            sendall(c->fd[0],v+begin,sizeof(float)*count);
+            recvall(c->fd[0],v+begin,sizeof(float)*count);
+            continue;
+        }
+        for(i=1; i<c->size; i++){
+            recvall(c->fd[i],c->buf,sizeof(float)*count);
+            for(j=0; j<count; j++)
+                v[begin+j]+=c->buf[j];
+        }
+        for(j=0; j<count; j++)
+            v[begin+j]*=scale;
+        for(i=1; i<c->size; i++)
+            sendall(c->fd[i],v+begin,sizeof(float)*count);
+    }
+}
+
+/* The parameters of n that are not rows of W1, in one vector */
+static float* gathersmall(nnet_t* n){
+    float* v=malloc(sizeof(float)*(2*n->hidden+n->members));
+    memcpy(v,n->b1,sizeof(float)*n->hidden);
+    memcpy(v+n->hidden,n->W2,sizeof(float)*n->hidden);
+    memcpy(v+2*n->hidden,n->b2,sizeof(float)*n->members);
+    return v;
+}
+
+static void scattersmall(nnet_t* n, float* v){
+    memcpy(n->b1,v,sizeof(float)*n->hidden);
+    memcpy(n->W2,v+n->hidden,sizeof(float)*n->hidden);
+    memcpy(n->b2,v+2*n->hidden,sizeof(float)*n->members);
+    free(v);
+}
+
+/* Gives every rank the initial weights of rank 0 */
+void broadcastnet(cluster_t* c, nnet_t* n){
+    float* v=gathersmall(n);
+    broadcast(c,n->W1[0],(size_t)n->inputs*n->hidden);
+    broadcast(c,v,2*n->hidden+n->members);
+    scattersmall(n,v);
+    if(n->accum!=NULL)
+        broadcast(c,n->accum,n->inputs+2);
+}
+
+/* Replaces the weights of n on every rank by their average */
+void averagenet(cluster_t* c, nnet_t* n){
+    float* v;
+    flushnet(n);
+    v=gathersmall(n);
+    allreduce(c,n->W1[0],(size_t)n->inputs*n->hidden);
+    allreduce(c,v,2*n->hidden+n->members);
+    scattersmall(n,v);
+    /* and the squared gradients of adaptive optimizers */
+    if(n->accum!=NULL)
+        allreduce(c,n->accum,n->inputs+2);
+}
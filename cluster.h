@@ -0,0 +1,35 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Declarations for training with several processes.         *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include "nnet.h"
+
+/* A group of processes training one network. Rank 0 accepts a
+ * connection from every other rank, the others are connected to
+ * rank 0 only.
+ */
+typedef struct cluster_t{
+    int rank;
+    int size;
+    int* fd;   /* rank 0: socket of each rank, others: fd[0] is rank 0 */
+    float* buf; /* receive buffer of the reductions */
+}cluster_t;
+
+void joincluster(cluster_t* c, const char* address, int rank, int size);
+void leavecluster(cluster_t* c);
+
+void broadcast(cluster_t* c, float* v, size_t len);
+void allreduce(cluster_t* c, float* v, size_t len);
+
+void broadcastnet(cluster_t* c, nnet_t* n);
+void averagenet(cluster_t* c, nnet_t* n);
+
+#endif /* CLUSTER_H */
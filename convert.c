@@ -0,0 +1,44 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Conversion of datasets to the binary cache format.         *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "dataset.h"
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char* argv[]){
+    dataset_t d;
+    char source[PATH_MAX];
+    int option;
+
+    const char* help="Usage: %s data cache\n";
+
+    while((option=getopt(argc,argv,""))!=EOF){
+        switch(option){
+            case '?': fprintf(stderr,help,argv[0]); exit(1); break;
+        }
+    }
+
+    if(argv[optind]==0 || argv[optind+1]==0){
+        fprintf(stderr,help,argv[0]);
+        exit(1);
+    }
+
+    /* Remember where the text came from so stale caches can be rebuilt */
+    if(realpath(argv[optind],source)==NULL){
+        fprintf(stderr,"Could not open file %s\n",argv[optind]);
+        exit(1);
+    }
+    loadData(source, &d);
+    if(!writeData(argv[optind+1], &d, d.map==NULL ? source : NULL))
+        exit(1);
+    printf("examples %d features %d\n",d.nex,d.nfeat);
+    freeData(&d);
+    return 0;
+}
@@ -9,7 +9,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "dataset.h"
+#include "telemetry.h"
 
 int getDimensions(FILE* fp, int* examples, int* features){
     char buf[4096];
@@ -68,141 +75,921 @@ int getDimensions(FILE* fp, int* examples, int* features){
     return max;	
 }
 
-int getSizes(FILE* fp, int maxline, dataset_t* d){
-    int target,offset,len,ex,nz,total;
+/* The loader below maps the whole file and cuts it into one
+ * newline aligned chunk per processor. Each chunk is parsed by
+ * its own thread into private arrays, which are then copied
+ * into the contiguous arrays of the dataset. The result is the
+ * same as reading the file line by line with fgets and sscanf.
+ */
+typedef struct chunk_t{
+    const char* begin; /* first byte of the chunk */
+    const char* end;   /* one past the last byte of the chunk */
+    int nex;           /* examples found in the chunk */
+    long nnz;          /* nonzeros found in the chunk */
+    int maxfeat;       /* largest feature index in the chunk */
+    int capex;
+    long capnz;
+    int* target;
+    int* nz;
+    int* idx;
+    float* x;
+    dataset_t* d;      /* destination, used when stitching */
+    int firstex;       /* index of the first example of the chunk in d */
+    long firstnz;      /* offset of its first nonzero in d */
+}chunk_t;
+
+static int isblank_(char c){
+    return c==' ' || c=='\t' || c=='\n' || c=='\v' || c=='\f' || c=='\r';
+}
+
+/* Parses an integer like %d does: leading whitespace, an
+ * optional sign and at least one digit. Returns 0 on failure.
+ */
+static int scanint(const char** s, const char* end, int* v){
+    const char* p=*s;
+    int neg=0;
+    unsigned int r=0;
+    while(p<end && isblank_(*p))
+        p++;
+    if(p<end && (*p=='-' || *p=='+'))
+        neg = *p++=='-';
+    if(p>=end || *p<'0' || *p>'9')
+        return 0;
+    while(p<end && *p>='0' && *p<='9')
+        r=10*r+(*p++-'0');
+    *v = neg ? -(int)r : (int)r;
+    *s=p;
+    return 1;
+}
+
+/* Powers of ten that are exact in single precision */
+static const float exact10[11]={1e0f,1e1f,1e2f,1e3f,1e4f,1e5f,1e6f,1e7f,1e8f,1e9f,1e10f};
+
+/* Parses a float like %f does. Plain decimals with at most seven
+ * significant digits are converted here: both the digits and
+ * the power of ten are exact floats, so one division gives the
+ * correctly rounded result, the same one strtof gives. Anything
+ * else (exponents, long mantissas, inf, nan) goes to strtof.
+ */
+static int scanfloat(const char** s, const char* end, float* v){
+    char buf[64];
+    const char* p=*s;
+    const char* q;
+    char* stop;
+    int neg=0,digits=0,frac=-1,len;
+    unsigned int m=0;
+    while(p<end && isblank_(*p))
+        p++;
+    q=p;
+    if(q<end && (*q=='-' || *q=='+'))
+        neg = *q++=='-';
+    for(; q<end; q++){
+        if(*q>='0' && *q<='9'){
+            if(frac>=0)
+                frac++;
+            if(m!=0 || *q!='0')
+                digits++;
+            m=10*m+(*q-'0');
+            if(digits>7)
+                break;
+        }
+        else if(*q=='.' && frac<0)
+            frac=0;
+        else
+            break;
+    }
+    if(digits<=7 && frac<=10 && q>p+neg && (q-p-neg>1 || frac<0) && (q==end || isblank_(*q))){
+        *v = (neg ? -(float)m : (float)m)/exact10[frac<0 ? 0 : frac];
+        *s=q;
+        return 1;
+    }
+    for(len=0; p+len<end && len<63 && !isblank_(p[len]); len++)
+        buf[len]=p[len];
+    buf[len]='\0';
+    *v=strtof(buf,&stop);
+    if(stop==buf)
+        return 0;
+    *s=p+(stop-buf);
+    return 1;
+}
+
+/* Parses the example in the text from line to end into s, which
+ * must have room for (end-line)/2 nonzeros. Features at or beyond
+ * maxfeat are thrown away. Returns 0 if the text holds no example,
+ * only blanks or a comment.
+ */
+int parseExample(const char* line, const char* end, int maxfeat, sparse_t* s, int* target){
+    const char *p,*comment;
+    int nz,feat;
+
+    /* remove comments */
+    comment=memchr(line,'#',end-line);
+    if(comment!=NULL)
+        end=comment;
+    for(p=line; p<end && isblank_(*p); p++)
+        ;
+    if(p==end)
+        /* The line was a comment */
+        return 0;
+    if(!scanint(&p,end,target))
+        *target=0;
+    *target = *target <=0 ? -1 : 1;
+    nz=0;
+    while(scanint(&p,end,&feat) && p<end && *p==':'){
+        p++;
+        if(!scanfloat(&p,end,&s->x[nz]))
+            break;
+        /* Throw away features that do not exist in the network.
+         * Ids from 2^31 on wrap to negative values, which are kept
+         * like the batch loader keeps them: hashing takes them as
+         * unsigned and prepvectors() drops them otherwise. */
+        if(feat<maxfeat){
+            s->idx[nz]=feat;
+            nz+=1;
+        }
+    }
+    s->nz=nz;
+    return 1;
+}
+
+/* Reads the next example from fp into s, which must have room
+ * for maxline nonzeros. Features at or beyond maxfeat are thrown
+ * away. Returns 0 at the end of the file.
+ */
+int readExample(FILE* fp, int maxline, int maxfeat, sparse_t* s, int* target){
     char* line;
-    char* comment;
 
-    total=0;
     line=malloc(maxline*sizeof(char));
-    rewind(fp);
 
-    ex=0;
     while(fgets(line,maxline,fp)!=NULL){
-        /* remove comments */
-        comment=strchr(line,'#');
-        if(comment!=NULL)
-            *comment = '\0';
-        if(sscanf(line,"%d%n",&target,&len)==EOF)
-            /* The line was a comment */
-            continue;
-        nz=0;
-        for(offset=len; line[offset]!='\0'; offset++){
-            if(line[offset]==':')
-                nz+=1;
+        if(parseExample(line,line+strlen(line),maxfeat,s,target)){
+            free(line);
+            return 1;
         }
-        d->example[ex].nz=nz;
-        total+=nz;
-        ex+=1;
     }
-    d->sparsity=total/(float)(d->nfeat*d->nex);
-
     free(line);
-    return total;
+    return 0;
 }
 
-void readExamples(FILE* fp, int maxline, dataset_t* d){
-    int i,ex,target,offset,feat,len;
-    float val;
+/* Finds the dimensions of the dataset in fp without keeping
+ * any examples, for training from a stream. Fills in nfeat, nex
+ * and sparsity of d and returns the maximum line length.
+ */
+int scanData(FILE* fp, dataset_t* d){
     char* line;
     char* comment;
+    long total;
+    int maxline,target,len;
 
+    maxline=getDimensions(fp, &d->nex, &d->nfeat);
     line=malloc(maxline*sizeof(char));
-    rewind(fp);
-    ex=0;
+    total=0;
     while(fgets(line,maxline,fp)!=NULL){
-        /* remove comments */
         comment=strchr(line,'#');
         if(comment!=NULL)
             *comment = '\0';
         if(sscanf(line,"%d%n",&target,&len)==EOF)
-            /* The line was a comment */
             continue;
-        d->target[ex] = target <= 0 ? -1 : 1;
-        for(i=0,offset=len; sscanf(line+offset,"%d:%f%n",&feat,&val,&len)>=2; i+=1,offset+=len){
-            d->example[ex].idx[i]=feat;
-            d->example[ex].x[i]=val;
+        for(; line[len]!='\0'; len++){
+            if(line[len]==':')
+                total+=1;
         }
-        ex+=1;
     }
+    rewind(fp);
     free(line);
+    d->sparsity=total/(float)((double)d->nfeat*d->nex);
+    d->example=NULL;
+    d->target=NULL;
+    d->map=NULL;
+    d->maplen=0;
+    return maxline;
 }
 
-int readExample(FILE* fp, int maxline, int maxfeat, sparse_t* s, int* target){
-    int i,nz,offset,feat,len;
-    float val;
-    char* line;
-    char* comment;
+static void growchunk(chunk_t* c, long nz){
+    if(c->nex==c->capex){
+        c->capex = c->capex ? 2*c->capex : 1024;
+        c->target=realloc(c->target,c->capex*sizeof(int));
+        c->nz=realloc(c->nz,c->capex*sizeof(int));
+    }
+    if(c->nnz+nz>c->capnz){
+        while(c->nnz+nz>c->capnz)
+            c->capnz = c->capnz ? 2*c->capnz : 16384;
+        c->idx=realloc(c->idx,c->capnz*sizeof(int));
+        c->x=realloc(c->x,c->capnz*sizeof(float));
+    }
+}
 
-    line=malloc(maxline*sizeof(char));
+static void* parsechunk(void* arg){
+    chunk_t* c=arg;
+    const char *p,*eol,*end,*q;
+    int target,feat,nz,i;
+    int* idx;
+    float* x;
 
-    while(fgets(line,maxline,fp)!=NULL){
+    for(p=c->begin; p<c->end; p=eol+1){
+        eol=memchr(p,'\n',c->end-p);
+        if(eol==NULL)
+            eol=c->end;
         /* remove comments */
-        comment=strchr(line,'#');
-        if(comment!=NULL)
-            *comment = '\0';
-        if(sscanf(line,"%d%n",target,&len)==EOF)
+        end=memchr(p,'#',eol-p);
+        if(end==NULL)
+            end=eol;
+        q=p;
+        while(q<end && isblank_(*q))
+            q++;
+        if(q==end)
             /* The line was a comment */
             continue;
-        *target = *target <=0 ? -1 : 1;
+        if(!scanint(&q,end,&target))
+            target=0;
         nz=0;
-        for(offset=len; line[offset]!='\0'; offset++){
-            if(line[offset]==':')
+        for(p=q; p<end; p++){
+            if(*p==':')
                 nz+=1;
         }
-        s->nz=nz;
-        for(i=0,offset=len; sscanf(line+offset,"%d:%f%n",&feat,&val,&len)>=2; i+=1,offset+=len){
-            /* Throw away features that do not exist in the network */
-            if (feat < maxfeat){
-                s->idx[i]=feat;
-                s->x[i]=val;
-            }
+        growchunk(c,nz);
+        c->target[c->nex] = target <= 0 ? -1 : 1;
+        c->nz[c->nex] = nz;
+        idx=c->idx+c->nnz;
+        x=c->x+c->nnz;
+        for(i=0; i<nz; i++){
+            if(!scanint(&q,end,&feat) || q>=end || *q!=':')
+                break;
+            q++;
+            if(!scanfloat(&q,end,&x[i]))
+                break;
+            idx[i]=feat;
+            if(c->maxfeat<feat)
+                c->maxfeat=feat;
         }
-        free(line);
-        return 1;
+        for(; i<nz; i++){
+            idx[i]=0;
+            x[i]=0.0f;
+        }
+        c->nex+=1;
+        c->nnz+=nz;
     }
-    free(line);
-    return 0;
+    return NULL;
 }
 
-void loadData(const char* name, dataset_t* d){
-    FILE* fp;
-    int total,i,maxline;
+static void* stitchchunk(void* arg){
+    chunk_t* c=arg;
+    dataset_t* d=c->d;
+    int i;
+    memcpy(d->target+c->firstex, c->target, c->nex*sizeof(int));
+    memcpy(d->example[0].x+c->firstnz, c->x, c->nnz*sizeof(float));
+    memcpy(d->example[0].idx+c->firstnz, c->idx, c->nnz*sizeof(int));
+    for(i=0; i<c->nex; i++)
+        d->example[c->firstex+i].nz=c->nz[i];
+    free(c->target);
+    free(c->nz);
+    free(c->idx);
+    free(c->x);
+    return NULL;
+}
 
-    fp=fopen(name,"r");
-    if(fp==NULL){
+/* Runs fn on every chunk, one thread per chunk */
+static void eachchunk(void* (*fn)(void*), chunk_t* c, int nchunks){
+    pthread_t* tid;
+    int i;
+    if(nchunks==1){
+        fn(c);
+        return;
+    }
+    tid=malloc(nchunks*sizeof(pthread_t));
+    for(i=0; i<nchunks; i++)
+        pthread_create(&tid[i], NULL, fn, &c[i]);
+    for(i=0; i<nchunks; i++)
+        pthread_join(tid[i], NULL);
+    free(tid);
+}
+
+/* Maps a whole file read-only. Empty files give NULL. */
+static const char* mapfile(const char* name, size_t* size){
+    struct stat st;
+    const char* text;
+    int fd;
+
+    fd=open(name,O_RDONLY);
+    if(fd<0 || fstat(fd,&st)<0){
         printf("Could not open file %s\n",name);
         exit(1);
     }
-    maxline=getDimensions(fp, &d->nex, &d->nfeat);
-    d->example=malloc(d->nex*sizeof(sparse_t));
+    *size=st.st_size;
+    text=NULL;
+    if(st.st_size>0){
+        text=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(text==MAP_FAILED){
+            printf("Could not map file %s\n",name);
+            exit(1);
+        }
+    }
+    close(fd);
+    return text;
+}
+
+static void parseText(const char* text, size_t size, dataset_t* d){
+    chunk_t* c;
+    const char* p;
+    long total,i;
+    int nchunks,maxfeat;
+
+    if(text!=NULL)
+        madvise((void*)text,size,MADV_SEQUENTIAL);
+    /* Small files are not worth the threads */
+    nchunks=sysconf(_SC_NPROCESSORS_ONLN);
+    if(nchunks>1+(long)(size/(1<<20)))
+        nchunks=1+size/(1<<20);
+    if(nchunks<1)
+        nchunks=1;
+    c=calloc(nchunks,sizeof(chunk_t));
+    p=text;
+    for(i=0; i<nchunks; i++){
+        c[i].begin=p;
+        p = i==nchunks-1 ? text+size : text+size*(i+1)/nchunks;
+        if(p<c[i].begin)
+            p=c[i].begin;
+        while(p<text+size && p>text && p[-1]!='\n')
+            p++;
+        c[i].end=p;
+    }
+    eachchunk(parsechunk,c,nchunks);
+
+    d->nex=0;
+    total=0;
+    maxfeat=0;
+    for(i=0; i<nchunks; i++){
+        c[i].d=d;
+        c[i].firstex=d->nex;
+        c[i].firstnz=total;
+        d->nex+=c[i].nex;
+        total+=c[i].nnz;
+        if(maxfeat<c[i].maxfeat)
+            maxfeat=c[i].maxfeat;
+    }
+    /* This is because the array of features is starting from 0 */
+    d->nfeat=maxfeat+1;
+    d->sparsity=total/(float)((double)d->nfeat*d->nex);
+    d->map=NULL;
+    d->maplen=0;
+    d->example=malloc((d->nex>0 ? d->nex : 1)*sizeof(sparse_t));
     d->target=malloc(d->nex*sizeof(int));
-    total=getSizes(fp, maxline, d);
     d->example[0].x=malloc(total*sizeof(float));
     d->example[0].idx=malloc(total*sizeof(int));
-
+    d->example[0].nz=0;
+    eachchunk(stitchchunk,c,nchunks);
     for(i=1; i<d->nex; i++){
         d->example[i].x=d->example[i-1].x+d->example[i-1].nz;
         d->example[i].idx=d->example[i-1].idx+d->example[i-1].nz;
     }
-    /* Finally memory has been set up and we can read the data */
-    readExamples(fp, maxline, d);
-    fclose(fp);
+    free(c);
+}
+
+/* Binary dataset cache. All sections start at multiples of
+ * DATA_ALIGN bytes so the arrays can be used straight from
+ * the mapping. The source fields describe the text file the
+ * cache was built from; a cache whose source has changed is
+ * rebuilt when it is loaded.
+ */
+#define DATA_MAGIC "SPNNDATA"
+#define DATA_VERSION 1
+#define DATA_ENDIAN 0x01020304u
+#define DATA_ALIGN 64
+
+typedef struct dataheader_t{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;   /* DATA_ENDIAN as stored by the writer */
+    int32_t nfeat;
+    int32_t nex;
+    float sparsity;
+    uint32_t unused;
+    int64_t nnz;
+    uint64_t srcsize;  /* size of the source text file */
+    int64_t srcmtime;  /* its modification time */
+    uint64_t srcsum;   /* its checksum, see checksum() */
+    uint64_t name;     /* offset of the source file name */
+    uint64_t target;   /* offset of int32 targets[nex] */
+    uint64_t offset;   /* offset of int64 offsets[nex+1] into idx and x */
+    uint64_t idx;      /* offset of int32 idx[nnz] */
+    uint64_t x;        /* offset of float x[nnz] */
+}dataheader_t;
+
+/* A 64 bit FNV-1a style hash over 8 byte words */
+static uint64_t checksum(const char* text, size_t size){
+    uint64_t h=14695981039346656037ull;
+    uint64_t w;
+    size_t i;
+    for(i=0; i+8<=size; i+=8){
+        memcpy(&w,text+i,8);
+        h=(h^w)*1099511628211ull;
+    }
+    for(; i<size; i++)
+        h=(h^(unsigned char)text[i])*1099511628211ull;
+    return h;
+}
+
+static uint64_t alignup(uint64_t x){
+    return (x+DATA_ALIGN-1)/DATA_ALIGN*DATA_ALIGN;
+}
+
+static void writeat(FILE* fp, uint64_t offset, const void* p, size_t size){
+    static const char zeros[DATA_ALIGN];
+    long pos=ftell(fp);
+    if(pos<(long)offset)
+        fwrite(zeros,1,offset-pos,fp);
+    fwrite(p,1,size,fp);
+}
+
+/* Writes d to a binary cache file. If source is not NULL it
+ * names the text file d was read from. The file is written to
+ * a temporary name first and then renamed over name.
+ */
+int writeData(const char* name, dataset_t* d, const char* source){
+    dataheader_t h;
+    struct stat st;
+    char* tmp;
+    const char* text;
+    int64_t* offsets;
+    size_t size;
+    FILE* fp;
+    int i,failed;
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,DATA_MAGIC,8);
+    h.version=DATA_VERSION;
+    h.endian=DATA_ENDIAN;
+    h.nfeat=d->nfeat;
+    h.nex=d->nex;
+    h.sparsity=d->sparsity;
+    offsets=malloc((d->nex+1)*sizeof(int64_t));
+    offsets[0]=0;
+    for(i=0; i<d->nex; i++)
+        offsets[i+1]=offsets[i]+d->example[i].nz;
+    h.nnz=offsets[d->nex];
+    if(source!=NULL && stat(source,&st)==0){
+        h.srcsize=st.st_size;
+        h.srcmtime=st.st_mtime;
+        text=mapfile(source,&size);
+        h.srcsum=checksum(text,size);
+        if(text!=NULL)
+            munmap((void*)text,size);
+    }
+    else
+        source="";
+    h.name=alignup(sizeof(h));
+    h.target=alignup(h.name+strlen(source)+1);
+    h.offset=alignup(h.target+d->nex*sizeof(int32_t));
+    h.idx=alignup(h.offset+(d->nex+1)*sizeof(int64_t));
+    h.x=alignup(h.idx+h.nnz*sizeof(int32_t));
+
+    tmp=malloc(strlen(name)+16);
+    sprintf(tmp,"%s.tmp%d",name,(int)getpid());
+    fp=fopen(tmp,"wb");
+    if(fp==NULL){
+        fprintf(stderr,"Could not write to file %s\n",tmp);
+        free(tmp);
+        free(offsets);
+        return 0;
+    }
+    fwrite(&h,sizeof(h),1,fp);
+    writeat(fp,h.name,source,strlen(source)+1);
+    writeat(fp,h.target,d->target,d->nex*sizeof(int32_t));
+    writeat(fp,h.offset,offsets,(d->nex+1)*sizeof(int64_t));
+    /* The examples are contiguous unless they have been clipped */
+    for(i=0; i<d->nex; i++)
+        writeat(fp,h.idx+offsets[i]*sizeof(int32_t),d->example[i].idx,d->example[i].nz*sizeof(int32_t));
+    for(i=0; i<d->nex; i++)
+        writeat(fp,h.x+offsets[i]*sizeof(float),d->example[i].x,d->example[i].nz*sizeof(float));
+    free(offsets);
+    /* A short write must not replace a good cache */
+    failed=ferror(fp);
+    if(fclose(fp)!=0 || failed || rename(tmp,name)!=0){
+        fprintf(stderr,"Could not write to file %s\n",name);
+        unlink(tmp);
+        free(tmp);
+        return 0;
+    }
+    free(tmp);
+    return 1;
+}
+
+/* Tells whether the source of a cache changed after the cache
+ * was written. Size and time are checked first so that the
+ * checksum is only computed when they disagree. The cache is
+ * not touched when only the time changed, as after a touch or
+ * a copy, since other processes may have it mapped; such a
+ * source is checksummed on every load until the cache is
+ * written again.
+ */
+static int stale(const dataheader_t* h, const char* source){
+    struct stat st;
+    const char* text;
+    size_t size;
+    uint64_t sum;
+
+    if(source[0]=='\0' || stat(source,&st)!=0)
+        /* Nothing to compare with, trust the cache */
+        return 0;
+    if((uint64_t)st.st_size==h->srcsize && st.st_mtime==h->srcmtime)
+        return 0;
+    if((uint64_t)st.st_size!=h->srcsize)
+        return 1;
+    text=mapfile(source,&size);
+    sum=checksum(text,size);
+    if(text!=NULL)
+        munmap((void*)text,size);
+    return sum!=h->srcsum;
+}
+
+/* Whether a section of len bytes at offset, as writeData() lays
+ * them out, lies inside a cache of size bytes
+ */
+static int insection(uint64_t offset, uint64_t len, size_t size){
+    return offset>=sizeof(dataheader_t) && offset%DATA_ALIGN==0
+        && offset<=size && len<=size-offset;
+}
+
+/* Sets up d to use the arrays of a mapped cache in place */
+static void mapData(const char* name, const char* map, size_t size, dataset_t* d){
+    const dataheader_t* h=(const dataheader_t*)map;
+    const int64_t* offsets;
+    const char* source;
+    const char* text;
+    size_t textsize;
+    int i;
+
+    if(h->version!=DATA_VERSION || h->endian!=DATA_ENDIAN){
+        printf("File %s was written by an incompatible version or machine\n",name);
+        exit(1);
+    }
+    if(h->nfeat<0 || h->nex<0 || h->nnz<0
+        || !insection(h->name,1,size) || memchr(map+h->name,'\0',size-h->name)==NULL
+        || !insection(h->target,(uint64_t)h->nex*sizeof(int32_t),size)
+        || !insection(h->offset,((uint64_t)h->nex+1)*sizeof(int64_t),size)
+        || !insection(h->idx,(uint64_t)h->nnz*sizeof(int32_t),size)
+        || !insection(h->x,(uint64_t)h->nnz*sizeof(float),size)){
+        printf("File %s is truncated or corrupt\n",name);
+        exit(1);
+    }
+    source=map+h->name;
+    if(stale(h,source)){
+        fprintf(stderr,"Cache %s is older than %s, rebuilding it\n",name,source);
+        text=mapfile(source,&textsize);
+        parseText(text,textsize,d);
+        if(text!=NULL)
+            munmap((void*)text,textsize);
+        writeData(name,d,source);
+        munmap((void*)map,size);
+        return;
+    }
+    offsets=(const int64_t*)(map+h->offset);
+    if(offsets[0]!=0 || offsets[h->nex]!=h->nnz){
+        printf("File %s is truncated or corrupt\n",name);
+        exit(1);
+    }
+    d->nfeat=h->nfeat;
+    d->nex=h->nex;
+    d->sparsity=h->sparsity;
+    d->target=(int*)(map+h->target);
+    d->map=(void*)map;
+    d->maplen=size;
+    d->example=malloc((d->nex>0 ? d->nex : 1)*sizeof(sparse_t));
+    for(i=0; i<d->nex; i++){
+        /* Increasing offsets that end at nnz keep every example inside idx and x */
+        if(offsets[i+1]<offsets[i]){
+            printf("File %s is truncated or corrupt\n",name);
+            exit(1);
+        }
+        d->example[i].idx=(int*)(map+h->idx)+offsets[i];
+        d->example[i].x=(float*)(map+h->x)+offsets[i];
+        d->example[i].nz=offsets[i+1]-offsets[i];
+    }
+}
+
+/* Loads a dataset from a text file in LIBSVM format or from
+ * a binary cache written by writeData().
+ */
+void loadData(const char* name, dataset_t* d){
+    const char* text;
+    size_t size;
+    TELEMETRY_TIMER(tick);
+
+    text=mapfile(name,&size);
+    if(size>=sizeof(dataheader_t) && memcmp(text,DATA_MAGIC,8)==0){
+        mapData(name,text,size,d);
+        return;
+    }
+    parseText(text,size,d);
+    TELEMETRY_LAP(TM_PARSE, tick);
+    if(text!=NULL)
+        munmap((void*)text,size);
 }
 
 void freeData(dataset_t* d){  
+    if(d->map!=NULL){
+        munmap(d->map,d->maplen);
+        free(d->example);
+        return;
+    }
     free(d->target);
     free(d->example[0].x);
     free(d->example[0].idx);
     free(d->example);
 }
 
-void clipvectors(int inputs, sparse_t* v, int len){
+/* Copies the examples perm[0], ..., perm[count-1] of src, in
+ * that order, into dst, whose nonzeros are one contiguous array,
+ * so going through dst in order reads memory sequentially. dst
+ * must be zeroed the first time. It gets room for all of src, so
+ * later copies from the same set reuse its memory. Free it with
+ * freeData().
+ */
+void permuteData(const dataset_t* src, const int* perm, int count, dataset_t* dst){
+    const sparse_t* v;
+    float* x;
+    int* idx;
+    long nz;
+    int i;
+
+    if(dst->example==NULL){
+        nz=0;
+        for(i=0; i<src->nex; i++)
+            nz+=src->example[i].nz;
+        dst->example=malloc(sizeof(sparse_t)*(src->nex>0 ? src->nex : 1));
+        dst->target=malloc(sizeof(int)*(src->nex>0 ? src->nex : 1));
+        dst->example[0].x=malloc(sizeof(float)*(nz>0 ? nz : 1));
+        dst->example[0].idx=malloc(sizeof(int)*(nz>0 ? nz : 1));
+        dst->map=NULL;
+        dst->maplen=0;
+    }
+    dst->nfeat=src->nfeat;
+    dst->sparsity=src->sparsity;
+    dst->nex=count;
+    x=dst->example[0].x;
+    idx=dst->example[0].idx;
+    for(i=0; i<count; i++){
+        v=&src->example[perm[i]];
+        memcpy(x,v->x,sizeof(float)*v->nz);
+        memcpy(idx,v->idx,sizeof(int)*v->nz);
+        dst->example[i].x=x;
+        dst->example[i].idx=idx;
+        dst->example[i].nz=v->nz;
+        dst->target[i]=src->target[perm[i]];
+        x+=v->nz;
+        idx+=v->nz;
+    }
+}
+
+/* Makes the arrays of a dataset that lives in a mapped cache
+ * writable. The mapping is private, so the pages that get
+ * modified are copied and the cache file is left alone.
+ */
+void writableData(dataset_t* d){
+    if(d->map!=NULL)
+        mprotect(d->map,d->maplen,PROT_READ|PROT_WRITE);
+}
+
+/* Replaces every feature index with its bucket among 2^bits
+ * buckets. With sign set, half of the features also get their
+ * value negated, which keeps collisions unbiased in expectation.
+ */
+void hashvectors(int bits, int sign, sparse_t* v, int len){
+    uint64_t h;
     int i,j;
     for(i=0; i<len; i++){
-        for(j=v[i].nz-1; j>=0 && v[i].idx[j] >= inputs; j--)
-            ;
-        v[i].nz=j+1;
+        for(j=0; j<v[i].nz; j++){
+            /* the finalizer of MurmurHash3 */
+            h=(uint32_t)v[i].idx[j];
+            h^=h>>33;
+            h*=0xff51afd7ed558ccdull;
+            h^=h>>33;
+            h*=0xc4ceb9fe1a85ec53ull;
+            h^=h>>33;
+            v[i].idx[j]=(int)(h&((1u<<bits)-1));
+            if(sign && (h>>63))
+                v[i].x[j]=-v[i].x[j];
+        }
+    }
+}
+
+static int cmpint(const void* a, const void* b){
+    int x=*(const int*)a, y=*(const int*)b;
+    return x<y ? -1 : x>y;
+}
+
+/* Open addressing table from feature ids to rows */
+typedef struct idtable_t{
+    int* key; /* -1 marks an empty slot */
+    int* val;
+    long size; /* a power of two */
+    long used;
+}idtable_t;
+
+static long idslot(idtable_t* t, int key){
+    long s=((uint32_t)key*2654435761u)&(t->size-1);
+    while(t->key[s]!=-1 && t->key[s]!=key)
+        s=(s+1)&(t->size-1);
+    return s;
+}
+
+static void idinit(idtable_t* t, long size){
+    t->size=size;
+    t->used=0;
+    t->key=malloc(size*sizeof(int));
+    t->val=malloc(size*sizeof(int));
+    memset(t->key,-1,size*sizeof(int));
+}
+
+static void idinsert(idtable_t* t, int key){
+    idtable_t bigger;
+    long s,i;
+    s=idslot(t,key);
+    if(t->key[s]==key)
+        return;
+    t->key[s]=key;
+    t->used+=1;
+    if(2*t->used>t->size){
+        idinit(&bigger,2*t->size);
+        for(i=0; i<t->size; i++){
+            if(t->key[i]!=-1)
+                bigger.key[idslot(&bigger,t->key[i])]=t->key[i];
+        }
+        bigger.used=t->used;
+        free(t->key);
+        free(t->val);
+        *t=bigger;
+    }
+}
+
+/* A feature and how often it occurs, for frequency ordering */
+typedef struct idcount_t{
+    int id;
+    int count;
+    int row;
+}idcount_t;
+
+static int cmpcount(const void* a, const void* b){
+    const idcount_t* x=a;
+    const idcount_t* y=b;
+    if(x->count!=y->count)
+        return x->count>y->count ? -1 : 1;
+    return x->id<y->id ? -1 : x->id>y->id;
+}
+
+static int cmpid(const void* a, const void* b){
+    const idcount_t* x=a;
+    const idcount_t* y=b;
+    return x->id<y->id ? -1 : x->id>y->id;
+}
+
+/* Sorts the nonzeros of v by index. Vectors are short, so
+ * insertion sort does.
+ */
+static void sortvector(sparse_t* v){
+    int i,j,idx;
+    float x;
+    for(i=1; i<v->nz; i++){
+        idx=v->idx[i];
+        x=v->x[i];
+        for(j=i; j>0 && v->idx[j-1]>idx; j--){
+            v->idx[j]=v->idx[j-1];
+            v->x[j]=v->x[j-1];
+        }
+        v->idx[j]=idx;
+        v->x[j]=x;
+    }
+}
+
+/* Renumbers the features of the vectors so that only the ones
+ * that occur get a row: the smallest id becomes 0, the next one
+ * 1 and so on, so sorted vectors stay sorted. The original ids
+ * are returned in dict, in increasing order, and their number is
+ * returned. The vectors must be writable.
+ *
+ * If order is not NULL, the features are numbered by decreasing
+ * number of occurrences instead, so the rows of the features that
+ * are in almost every example are next to each other in memory,
+ * and the nonzeros of every vector are sorted again. Then dict is
+ * not increasing, and order receives the rows sorted by their
+ * feature id, which remapvectors() needs to look ids up.
+ */
+int compactvectors(sparse_t* v, int len, int** dict, int** order){
+    idtable_t t;
+    idcount_t* c;
+    int i,j,n;
+
+    idinit(&t,1024);
+    for(i=0; i<len; i++){
+        for(j=0; j<v[i].nz; j++)
+            idinsert(&t,v[i].idx[j]);
+    }
+    *dict=malloc((t.used>0 ? t.used : 1)*sizeof(int));
+    if(order==NULL){
+        for(n=0,i=0; i<t.size; i++){
+            if(t.key[i]!=-1)
+                (*dict)[n++]=t.key[i];
+        }
+        qsort(*dict,n,sizeof(int),cmpint);
+        for(i=0; i<n; i++)
+            t.val[idslot(&t,(*dict)[i])]=i;
+    }
+    else{
+        memset(t.val,0,t.size*sizeof(int));
+        for(i=0; i<len; i++){
+            for(j=0; j<v[i].nz; j++)
+                t.val[idslot(&t,v[i].idx[j])]+=1;
+        }
+        c=malloc((t.used>0 ? t.used : 1)*sizeof(idcount_t));
+        for(n=0,i=0; i<t.size; i++){
+            if(t.key[i]!=-1){
+                c[n].id=t.key[i];
+                c[n].count=t.val[i];
+                n+=1;
+            }
+        }
+        qsort(c,n,sizeof(idcount_t),cmpcount);
+        for(i=0; i<n; i++){
+            (*dict)[i]=c[i].id;
+            c[i].row=i;
+            t.val[idslot(&t,c[i].id)]=i;
+        }
+        qsort(c,n,sizeof(idcount_t),cmpid);
+        *order=malloc((n>0 ? n : 1)*sizeof(int));
+        for(i=0; i<n; i++)
+            (*order)[i]=c[i].row;
+        free(c);
+    }
+    for(i=0; i<len; i++){
+        for(j=0; j<v[i].nz; j++)
+            v[i].idx[j]=t.val[idslot(&t,v[i].idx[j])];
+        if(order!=NULL)
+            sortvector(&v[i]);
+    }
+    free(t.key);
+    free(t.val);
+    return n;
+}
+
+/* Row of feature id in a dictionary made by compactvectors(),
+ * or -1 if it is not there.
+ */
+static int findrow(const int* dict, const int* order, int ndict, int id){
+    int lo=0,hi=ndict,mid,row;
+    while(lo<hi){
+        mid=lo+(hi-lo)/2;
+        row = order==NULL ? mid : order[mid];
+        if(dict[row]==id)
+            return row;
+        if(dict[row]<id)
+            lo=mid+1;
+        else
+            hi=mid;
+    }
+    return -1;
+}
+
+/* Renumbers the features of the vectors with a dictionary made
+ * by compactvectors(), with the order it made if it made one.
+ * Features that are not in the dictionary are dropped, like
+ * clipvectors() drops features that are too large. The vectors
+ * must be writable.
+ */
+void remapvectors(const int* dict, const int* order, int ndict, sparse_t* v, int len){
+    int i,j,nz,row;
+    for(i=0; i<len; i++){
+        nz=0;
+        for(j=0; j<v[i].nz; j++){
+            row=findrow(dict,order,ndict,v[i].idx[j]);
+            if(row<0)
+                continue;
+            v[i].idx[nz]=row;
+            v[i].x[nz]=v[i].x[j];
+            nz+=1;
+        }
+        v[i].nz=nz;
+        if(order!=NULL)
+            sortvector(&v[i]);
+    }
+}
+
+/* Drops the features of the vectors that have no row among the
+ * given number of inputs. The features are not assumed to be
+ * sorted, since vectors that come from a stream or a socket may
+ * not be. The vectors must be writable.
+ */
+void clipvectors(int inputs, sparse_t* v, int len){
+    int i,j,nz;
+    for(i=0; i<len; i++){
+        nz=0;
+        for(j=0; j<v[i].nz; j++){
+            if(v[i].idx[j]<0 || v[i].idx[j]>=inputs)
+                continue;
+            v[i].idx[nz]=v[i].idx[j];
+            v[i].x[nz]=v[i].x[j];
+            nz+=1;
+        }
+        v[i].nz=nz;
     }
 }
 
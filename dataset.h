@@ -24,12 +24,22 @@ typedef struct dataset_t{
     int nfeat;         /* number of features */
     int nex;           /* number of examples */
     float sparsity;    /* fraction of nonzero features in a typical vector */
+    void* map;         /* mapped cache holding the arrays, NULL if they are malloc'd */
+    size_t maplen;     /* length of the mapping */
 }dataset_t;
 
 void loadData(const char* name, dataset_t* d);
 int getDimensions(FILE* fp, int* examples, int* features);
 int readExample(FILE* fp, int maxline, int maxfeat, sparse_t* s, int* target);
+int parseExample(const char* line, const char* end, int maxfeat, sparse_t* s, int* target);
+int scanData(FILE* fp, dataset_t* d);
+int writeData(const char* name, dataset_t* d, const char* source);
 void freeData(dataset_t* d); 
+void writableData(dataset_t* d);
+void permuteData(const dataset_t* src, const int* perm, int count, dataset_t* dst);
+void hashvectors(int bits, int sign, sparse_t* v, int len);
+int compactvectors(sparse_t* v, int len, int** dict, int** order);
+void remapvectors(const int* dict, const int* order, int ndict, sparse_t* v, int len);
 void clipvectors(int inputs, sparse_t* v, int len);
 
 #endif
@@ -0,0 +1,130 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Generator of synthetic datasets for benchmarks.            *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Random number in [0,1) from a 64 bit xorshift* generator, so
+ * the output only depends on the seed and not on the libc.
+ */
+static double uniform(unsigned long long* s){
+    *s^=*s>>12;
+    *s^=*s<<25;
+    *s^=*s>>27;
+    return ((*s*2685821657736338717ULL)>>11)*(1.0/9007199254740992.0);
+}
+
+static int compareint(const void* a, const void* b){
+    int x=*(const int*)a;
+    int y=*(const int*)b;
+    return (x>y)-(x<y);
+}
+
+/* Index of the first entry of the cumulative distribution cdf
+ * that exceeds u.
+ */
+static int draw(const double* cdf, int n, double u){
+    int lo=0,hi=n-1,mid;
+    while(lo<hi){
+        mid=(lo+hi)/2;
+        if(cdf[mid]>u)
+            hi=mid;
+        else
+            lo=mid+1;
+    }
+    return lo;
+}
+
+int main(int argc, char* argv[]){
+    unsigned long long seed=1;
+    double skew=1.0;
+    double *cdf,*w;
+    double sum,margin;
+    int rows=100000;
+    int features=1000000;
+    int nonzeros=40;
+    int *idx;
+    float* x;
+    int option;
+    int i,j,k,nz;
+    FILE* fp;
+
+    const char* help="Usage: %s [options] output\nAvailable options:\n\
+            -a <float>: Zipf exponent of the feature frequencies, 0 for uniform (default: 1)\n\
+            -f <int>  : number of features (default: 1000000)\n\
+            -n <int>  : number of examples (default: 100000)\n\
+            -s <int>  : random seed (default: 1)\n\
+            -z <int>  : nonzeros per example (default: 40)\n";
+
+    while((option=getopt(argc,argv,"a:f:n:s:z:"))!=EOF){
+        switch(option){
+            case 'a': skew=atof(optarg); break;
+            case 'f': features=atoi(optarg); break;
+            case 'n': rows=atoi(optarg); break;
+            case 's': seed=strtoull(optarg,NULL,10); break;
+            case 'z': nonzeros=atoi(optarg); break;
+            case '?': fprintf(stderr,help,argv[0]); exit(1); break;
+        }
+    }
+    if(argv[optind]==0 || features<1 || rows<1 || nonzeros<1 || skew<0){
+        fprintf(stderr,help,argv[0]);
+        exit(1);
+    }
+    if(seed==0)
+        seed=1;
+    fp=fopen(argv[optind],"w");
+    if(fp==NULL){
+        fprintf(stderr,"Could not open file %s\n",argv[optind]);
+        exit(1);
+    }
+
+    /* Feature k+1 occurs with probability proportional to 1/(k+1)^skew.
+     * The label is the sign of a random linear function with noise,
+     * so the data can be learned.
+     */
+    cdf=malloc(sizeof(double)*features);
+    w=malloc(sizeof(double)*features);
+    sum=0;
+    for(k=0; k<features; k++){
+        sum+=pow(k+1.0,-skew);
+        cdf[k]=sum;
+        w[k]=2*uniform(&seed)-1;
+    }
+    for(k=0; k<features; k++)
+        cdf[k]/=sum;
+    idx=malloc(sizeof(int)*nonzeros);
+    x=malloc(sizeof(float)*nonzeros);
+    for(i=0; i<rows; i++){
+        for(j=0; j<nonzeros; j++)
+            idx[j]=draw(cdf,features,uniform(&seed));
+        /* Frequent features are drawn more than once, keep one */
+        qsort(idx,nonzeros,sizeof(int),compareint);
+        for(j=nz=0; j<nonzeros; j++){
+            if(nz==0 || idx[j]!=idx[nz-1])
+                idx[nz++]=idx[j];
+        }
+        margin=0.5*(2*uniform(&seed)-1);
+        for(j=0; j<nz; j++){
+            x[j]=(float)uniform(&seed);
+            margin+=w[idx[j]]*x[j];
+        }
+        fprintf(fp,"%d",margin>0 ? 1 : -1);
+        for(j=0; j<nz; j++)
+            fprintf(fp," %d:%g",idx[j]+1,x[j]);
+        fprintf(fp,"\n");
+    }
+    fclose(fp);
+    free(cdf);
+    free(w);
+    free(idx);
+    free(x);
+    return 0;
+}
@@ -0,0 +1,649 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Sparse gather and scatter kernels with cpu dispatch.       *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "dataset.h"
+#include "kernels.h"
+#include <cblas.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/* The hidden layer is usually a few dozen units so calling
+ * saxpy once per nonzero spends more time in call overhead
+ * than in arithmetic. The kernels here instead walk the
+ * hidden layer in tiles that fit in registers and stream all
+ * the nonzeros of the example through each tile.
+ */
+
+static void gatherblas(float* a, const float* b, float** W, sparse_t* v, int len){
+    int i;
+    cblas_scopy(len,b,1,a,1);
+    for(i=0; i<v->nz; i++)
+        cblas_saxpy(len, v->x[i], W[v->idx[i]], 1, a, 1);
+}
+
+static void scatterblas(float** W, sparse_t* v, float eta, const float* d, int len){
+    int i;
+    for(i=0; i<v->nz; i++)
+        cblas_saxpy(len, eta*v->x[i], d, 1, W[v->idx[i]], 1);
+}
+
+/* Portable versions, tiles of 8 that the compiler can keep in registers */
+static void gathergeneric(float* a, const float* b, float** W, sparse_t* v, int len){
+    float acc[8];
+    const float* w;
+    float x;
+    int h,i,k,m;
+    for(h=0; h<len; h+=8){
+        m = len-h < 8 ? len-h : 8;
+        for(k=0; k<m; k++)
+            acc[k]=b[h+k];
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            x=v->x[i];
+            for(k=0; k<m; k++)
+                acc[k]+=x*w[k];
+        }
+        for(k=0; k<m; k++)
+            a[h+k]=acc[k];
+    }
+}
+
+static void scattergeneric(float** W, sparse_t* v, float eta, const float* d, int len){
+    float* w;
+    float c;
+    int h,i,k,m;
+    for(h=0; h<len; h+=8){
+        m = len-h < 8 ? len-h : 8;
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=eta*v->x[i];
+            for(k=0; k<m; k++)
+                w[k]+=c*d[k+h];
+        }
+    }
+}
+
+/* bfloat16 is the upper half of a float. Widening is a shift,
+ * narrowing rounds either to nearest even or stochastically:
+ * adding a random 16 bit value before truncating rounds up with
+ * probability equal to the discarded fraction, so updates much
+ * smaller than the spacing of bf16 values are kept on average.
+ */
+static float widen(uint16_t h){
+    uint32_t u=(uint32_t)h<<16;
+    float f;
+    memcpy(&f,&u,sizeof(f));
+    return f;
+}
+
+static uint16_t narrow(float f){
+    uint32_t u;
+    memcpy(&u,&f,sizeof(u));
+    return (uint16_t)((u+0x7fffu+((u>>16)&1))>>16);
+}
+
+static uint32_t xorshift(uint32_t* s){
+    uint32_t x=*s;
+    x^=x<<13;
+    x^=x>>17;
+    x^=x<<5;
+    return *s=x;
+}
+
+static uint16_t narrowrandom(float f, uint32_t r){
+    uint32_t u;
+    memcpy(&u,&f,sizeof(u));
+    return (uint16_t)((u+(r&0xffffu))>>16);
+}
+
+void tobf16(uint16_t* dst, const float* src, size_t n){
+    size_t i;
+    for(i=0; i<n; i++)
+        dst[i]=narrow(src[i]);
+}
+
+void tobf16random(uint16_t* dst, const float* src, size_t n, uint32_t* seed){
+    size_t i;
+    for(i=0; i<n; i++)
+        dst[i]=narrowrandom(src[i],xorshift(seed));
+}
+
+void frombf16(float* dst, const uint16_t* src, size_t n){
+    size_t i;
+    for(i=0; i<n; i++)
+        dst[i]=widen(src[i]);
+}
+
+void axpybf16(uint16_t* w, float a, const float* x, int len, uint32_t* seed){
+    int k;
+    for(k=0; k<len; k++)
+        w[k]=narrowrandom(widen(w[k])+a*x[k],xorshift(seed));
+}
+
+static void gatherhalfgeneric(float* a, const float* b, uint16_t** W, sparse_t* v, int len){
+    float acc[8];
+    const uint16_t* w;
+    float x;
+    int h,i,k,m;
+    for(h=0; h<len; h+=8){
+        m = len-h < 8 ? len-h : 8;
+        for(k=0; k<m; k++)
+            acc[k]=b[h+k];
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            x=v->x[i];
+            for(k=0; k<m; k++)
+                acc[k]+=x*widen(w[k]);
+        }
+        for(k=0; k<m; k++)
+            a[h+k]=acc[k];
+    }
+}
+
+/* Units begin to len-1 of the bf16 kernels */
+static void gatherhalftail(float* a, const float* b, uint16_t** W, sparse_t* v, int begin, int len){
+    int i,k;
+    for(k=begin; k<len; k++)
+        a[k]=b[k];
+    for(i=0; i<v->nz; i++){
+        for(k=begin; k<len; k++)
+            a[k]+=v->x[i]*widen(W[v->idx[i]][k]);
+    }
+}
+
+static void scatterhalftail(uint16_t** W, sparse_t* v, float eta, const float* d, int begin, int len, uint32_t* seed){
+    int i;
+    for(i=0; i<v->nz; i++)
+        axpybf16(W[v->idx[i]]+begin, eta*v->x[i], d+begin, len-begin, seed);
+}
+
+static void scatterhalfgeneric(uint16_t** W, sparse_t* v, float eta, const float* d, int len, uint32_t* seed){
+    int i;
+    for(i=0; i<v->nz; i++)
+        axpybf16(W[v->idx[i]], eta*v->x[i], d, len, seed);
+}
+
+#ifdef HAVE_X86
+
+/* Masks selecting the first 0..7 lanes of a 256 bit register */
+static const int lanes8[16]={-1,-1,-1,-1,-1,-1,-1,-1,0,0,0,0,0,0,0,0};
+
+__attribute__((target("avx2,fma")))
+static void gatheravx2(float* a, const float* b, float** W, sparse_t* v, int len){
+    __m256 a0,a1,a2,a3,x;
+    __m256i mask;
+    const float* w;
+    int h,i;
+    /* 32 hidden units per pass, 4 accumulators */
+    for(h=0; h+32<=len; h+=32){
+        a0=_mm256_loadu_ps(b+h);
+        a1=_mm256_loadu_ps(b+h+8);
+        a2=_mm256_loadu_ps(b+h+16);
+        a3=_mm256_loadu_ps(b+h+24);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            x=_mm256_set1_ps(v->x[i]);
+            a0=_mm256_fmadd_ps(x,_mm256_loadu_ps(w),a0);
+            a1=_mm256_fmadd_ps(x,_mm256_loadu_ps(w+8),a1);
+            a2=_mm256_fmadd_ps(x,_mm256_loadu_ps(w+16),a2);
+            a3=_mm256_fmadd_ps(x,_mm256_loadu_ps(w+24),a3);
+        }
+        _mm256_storeu_ps(a+h,a0);
+        _mm256_storeu_ps(a+h+8,a1);
+        _mm256_storeu_ps(a+h+16,a2);
+        _mm256_storeu_ps(a+h+24,a3);
+    }
+    for(; h+8<=len; h+=8){
+        a0=_mm256_loadu_ps(b+h);
+        for(i=0; i<v->nz; i++){
+            x=_mm256_set1_ps(v->x[i]);
+            a0=_mm256_fmadd_ps(x,_mm256_loadu_ps(W[v->idx[i]]+h),a0);
+        }
+        _mm256_storeu_ps(a+h,a0);
+    }
+    if(h<len){
+        mask=_mm256_loadu_si256((const __m256i*)(lanes8+8-(len-h)));
+        a0=_mm256_maskload_ps(b+h,mask);
+        for(i=0; i<v->nz; i++){
+            x=_mm256_set1_ps(v->x[i]);
+            a0=_mm256_fmadd_ps(x,_mm256_maskload_ps(W[v->idx[i]]+h,mask),a0);
+        }
+        _mm256_maskstore_ps(a+h,mask,a0);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void scatteravx2(float** W, sparse_t* v, float eta, const float* d, int len){
+    __m256 d0,d1,d2,d3,c;
+    __m256i mask;
+    float* w;
+    int h,i;
+    for(h=0; h+32<=len; h+=32){
+        d0=_mm256_loadu_ps(d+h);
+        d1=_mm256_loadu_ps(d+h+8);
+        d2=_mm256_loadu_ps(d+h+16);
+        d3=_mm256_loadu_ps(d+h+24);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=_mm256_set1_ps(eta*v->x[i]);
+            _mm256_storeu_ps(w,_mm256_fmadd_ps(c,d0,_mm256_loadu_ps(w)));
+            _mm256_storeu_ps(w+8,_mm256_fmadd_ps(c,d1,_mm256_loadu_ps(w+8)));
+            _mm256_storeu_ps(w+16,_mm256_fmadd_ps(c,d2,_mm256_loadu_ps(w+16)));
+            _mm256_storeu_ps(w+24,_mm256_fmadd_ps(c,d3,_mm256_loadu_ps(w+24)));
+        }
+    }
+    for(; h+8<=len; h+=8){
+        d0=_mm256_loadu_ps(d+h);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=_mm256_set1_ps(eta*v->x[i]);
+            _mm256_storeu_ps(w,_mm256_fmadd_ps(c,d0,_mm256_loadu_ps(w)));
+        }
+    }
+    if(h<len){
+        mask=_mm256_loadu_si256((const __m256i*)(lanes8+8-(len-h)));
+        d0=_mm256_maskload_ps(d+h,mask);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=_mm256_set1_ps(eta*v->x[i]);
+            _mm256_maskstore_ps(w,mask,_mm256_fmadd_ps(c,d0,_mm256_maskload_ps(w,mask)));
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void gatheravx512(float* a, const float* b, float** W, sparse_t* v, int len){
+    __m512 a0,a1,a2,a3,x;
+    __mmask16 mask;
+    const float* w;
+    int h,i;
+    /* 64 hidden units per pass, 4 accumulators */
+    for(h=0; h+64<=len; h+=64){
+        a0=_mm512_loadu_ps(b+h);
+        a1=_mm512_loadu_ps(b+h+16);
+        a2=_mm512_loadu_ps(b+h+32);
+        a3=_mm512_loadu_ps(b+h+48);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            x=_mm512_set1_ps(v->x[i]);
+            a0=_mm512_fmadd_ps(x,_mm512_loadu_ps(w),a0);
+            a1=_mm512_fmadd_ps(x,_mm512_loadu_ps(w+16),a1);
+            a2=_mm512_fmadd_ps(x,_mm512_loadu_ps(w+32),a2);
+            a3=_mm512_fmadd_ps(x,_mm512_loadu_ps(w+48),a3);
+        }
+        _mm512_storeu_ps(a+h,a0);
+        _mm512_storeu_ps(a+h+16,a1);
+        _mm512_storeu_ps(a+h+32,a2);
+        _mm512_storeu_ps(a+h+48,a3);
+    }
+    for(; h<len; h+=16){
+        mask = len-h >= 16 ? (__mmask16)0xffff : (__mmask16)((1u<<(len-h))-1);
+        a0=_mm512_maskz_loadu_ps(mask,b+h);
+        for(i=0; i<v->nz; i++){
+            x=_mm512_set1_ps(v->x[i]);
+            a0=_mm512_fmadd_ps(x,_mm512_maskz_loadu_ps(mask,W[v->idx[i]]+h),a0);
+        }
+        _mm512_mask_storeu_ps(a+h,mask,a0);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void scatteravx512(float** W, sparse_t* v, float eta, const float* d, int len){
+    __m512 d0,d1,d2,d3,c;
+    __mmask16 mask;
+    float* w;
+    int h,i;
+    for(h=0; h+64<=len; h+=64){
+        d0=_mm512_loadu_ps(d+h);
+        d1=_mm512_loadu_ps(d+h+16);
+        d2=_mm512_loadu_ps(d+h+32);
+        d3=_mm512_loadu_ps(d+h+48);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=_mm512_set1_ps(eta*v->x[i]);
+            _mm512_storeu_ps(w,_mm512_fmadd_ps(c,d0,_mm512_loadu_ps(w)));
+            _mm512_storeu_ps(w+16,_mm512_fmadd_ps(c,d1,_mm512_loadu_ps(w+16)));
+            _mm512_storeu_ps(w+32,_mm512_fmadd_ps(c,d2,_mm512_loadu_ps(w+32)));
+            _mm512_storeu_ps(w+48,_mm512_fmadd_ps(c,d3,_mm512_loadu_ps(w+48)));
+        }
+    }
+    for(; h<len; h+=16){
+        mask = len-h >= 16 ? (__mmask16)0xffff : (__mmask16)((1u<<(len-h))-1);
+        d0=_mm512_maskz_loadu_ps(mask,d+h);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=_mm512_set1_ps(eta*v->x[i]);
+            _mm512_mask_storeu_ps(w,mask,_mm512_fmadd_ps(c,d0,_mm512_maskz_loadu_ps(mask,w)));
+        }
+    }
+}
+
+/* The bf16 kernels widen 8 (or 16) weights at a time and leave
+ * the last len%8 (or len%16) units to the scalar code.
+ */
+__attribute__((target("avx2,fma")))
+static void gatherhalfavx2(float* a, const float* b, uint16_t** W, sparse_t* v, int len){
+    __m256 a0,a1,x;
+    const uint16_t* w;
+    int h,i;
+    for(h=0; h+16<=len; h+=16){
+        a0=_mm256_loadu_ps(b+h);
+        a1=_mm256_loadu_ps(b+h+8);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            x=_mm256_set1_ps(v->x[i]);
+            a0=_mm256_fmadd_ps(x,_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)w)),16)),a0);
+            a1=_mm256_fmadd_ps(x,_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(w+8))),16)),a1);
+        }
+        _mm256_storeu_ps(a+h,a0);
+        _mm256_storeu_ps(a+h+8,a1);
+    }
+    for(; h+8<=len; h+=8){
+        a0=_mm256_loadu_ps(b+h);
+        for(i=0; i<v->nz; i++){
+            x=_mm256_set1_ps(v->x[i]);
+            a0=_mm256_fmadd_ps(x,_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(W[v->idx[i]]+h))),16)),a0);
+        }
+        _mm256_storeu_ps(a+h,a0);
+    }
+    if(h<len)
+        gatherhalftail(a,b,W,v,h,len);
+}
+
+__attribute__((target("avx2,fma")))
+static void scatterhalfavx2(uint16_t** W, sparse_t* v, float eta, const float* d, int len, uint32_t* seed){
+    const __m256i low=_mm256_set1_epi32(0xffff);
+    __m256i s,r,u;
+    __m256 d0,c;
+    uint32_t lanes[8];
+    uint16_t* w;
+    int h,i,k;
+    /* 8 independent generators, one per lane */
+    for(k=0; k<8; k++)
+        lanes[k]=xorshift(seed);
+    s=_mm256_loadu_si256((const __m256i*)lanes);
+    for(h=0; h+8<=len; h+=8){
+        d0=_mm256_loadu_ps(d+h);
+        /* Different rows are different weights, so they can share
+         * the random bits; each weight still rounds without bias.
+         */
+        s=_mm256_xor_si256(s,_mm256_slli_epi32(s,13));
+        s=_mm256_xor_si256(s,_mm256_srli_epi32(s,17));
+        s=_mm256_xor_si256(s,_mm256_slli_epi32(s,5));
+        r=_mm256_and_si256(s,low);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=_mm256_set1_ps(eta*v->x[i]);
+            u=_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)w)),16);
+            u=_mm256_castps_si256(_mm256_fmadd_ps(c,d0,_mm256_castsi256_ps(u)));
+            u=_mm256_srli_epi32(_mm256_add_epi32(u,r),16);
+            /* pack the 8 results back to 16 bits, keeping their order */
+            u=_mm256_packus_epi32(u,u);
+            u=_mm256_permute4x64_epi64(u,0x08);
+            _mm_storeu_si128((__m128i*)w,_mm256_castsi256_si128(u));
+        }
+    }
+    if(h<len)
+        scatterhalftail(W,v,eta,d,h,len,seed);
+}
+
+__attribute__((target("avx512f")))
+static void gatherhalfavx512(float* a, const float* b, uint16_t** W, sparse_t* v, int len){
+    __m512 a0,a1,x;
+    const uint16_t* w;
+    int h,i;
+    for(h=0; h+32<=len; h+=32){
+        a0=_mm512_loadu_ps(b+h);
+        a1=_mm512_loadu_ps(b+h+16);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            x=_mm512_set1_ps(v->x[i]);
+            a0=_mm512_fmadd_ps(x,_mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)w)),16)),a0);
+            a1=_mm512_fmadd_ps(x,_mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(w+16))),16)),a1);
+        }
+        _mm512_storeu_ps(a+h,a0);
+        _mm512_storeu_ps(a+h+16,a1);
+    }
+    for(; h+16<=len; h+=16){
+        a0=_mm512_loadu_ps(b+h);
+        for(i=0; i<v->nz; i++){
+            x=_mm512_set1_ps(v->x[i]);
+            a0=_mm512_fmadd_ps(x,_mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(W[v->idx[i]]+h))),16)),a0);
+        }
+        _mm512_storeu_ps(a+h,a0);
+    }
+    if(h<len)
+        gatherhalftail(a,b,W,v,h,len);
+}
+
+__attribute__((target("avx512f")))
+static void scatterhalfavx512(uint16_t** W, sparse_t* v, float eta, const float* d, int len, uint32_t* seed){
+    const __m512i low=_mm512_set1_epi32(0xffff);
+    __m512i s,r,u;
+    __m512 d0,c;
+    uint32_t lanes[16];
+    uint16_t* w;
+    int h,i,k;
+    for(k=0; k<16; k++)
+        lanes[k]=xorshift(seed);
+    s=_mm512_loadu_si512(lanes);
+    for(h=0; h+16<=len; h+=16){
+        d0=_mm512_loadu_ps(d+h);
+        s=_mm512_xor_si512(s,_mm512_slli_epi32(s,13));
+        s=_mm512_xor_si512(s,_mm512_srli_epi32(s,17));
+        s=_mm512_xor_si512(s,_mm512_slli_epi32(s,5));
+        r=_mm512_and_si512(s,low);
+        for(i=0; i<v->nz; i++){
+            w=W[v->idx[i]]+h;
+            c=_mm512_set1_ps(eta*v->x[i]);
+            u=_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)w)),16);
+            u=_mm512_castps_si512(_mm512_fmadd_ps(c,d0,_mm512_castsi512_ps(u)));
+            u=_mm512_srli_epi32(_mm512_add_epi32(u,r),16);
+            _mm256_storeu_si256((__m256i*)w,_mm512_cvtepi32_epi16(u));
+        }
+    }
+    if(h<len)
+        scatterhalftail(W,v,eta,d,h,len,seed);
+}
+
+/* Vector versions of the scalar activation() in nnet.c. The
+ * sign and the saturation region (|x|>10) are handled with masks
+ * and blends instead of branches. Each returns how many leading
+ * entries it processed; the caller finishes the rest.
+ */
+__attribute__((target("avx2,fma")))
+static int activationavx2(const float* x, float* f, float* g, int n){
+    const __m256 signbit=_mm256_set1_ps(-0.0f);
+    const __m256 one=_mm256_set1_ps(1.0f);
+    const __m256 ten=_mm256_set1_ps(10.0f);
+    const __m256 scale=_mm256_set1_ps(1.732050807568877f);
+    const __m256 dscale=_mm256_set1_ps(1.14051899445142f);
+    const __m256 bias=_mm256_set1_ps(0.01f);
+    __m256 v,s,z,sat,y,y2,d,dd,t,u;
+    int i;
+    for(i=0; i+8<=n; i+=8){
+        v=_mm256_loadu_ps(x+i);
+        s=_mm256_and_ps(_mm256_cmp_ps(v,_mm256_setzero_ps(),_CMP_LT_OQ),signbit);
+        z=_mm256_andnot_ps(signbit,v);
+        sat=_mm256_cmp_ps(z,ten,_CMP_GT_OQ);
+        z=_mm256_min_ps(z,ten);
+        y=_mm256_fmsub_ps(_mm256_set1_ps(0.2f),z,one);
+        y2=_mm256_add_ps(y,y);
+        /* chebyshev 8, same recurrence as the scalar code */
+        dd=_mm256_set1_ps(0.00366079966971855f);
+        d=_mm256_fmadd_ps(y2,dd,_mm256_set1_ps(-0.00609954274163606f));
+        dd=_mm256_sub_ps(_mm256_fmadd_ps(y2,d,_mm256_set1_ps(0.00292879407703366f)),dd);
+        d=_mm256_sub_ps(_mm256_fmadd_ps(y2,dd,_mm256_set1_ps(0.0154392072571603f)),d);
+        dd=_mm256_sub_ps(_mm256_fmadd_ps(y2,d,_mm256_set1_ps(-0.0620003898943956f)),dd);
+        d=_mm256_sub_ps(_mm256_fmadd_ps(y2,dd,_mm256_set1_ps(0.144460219650769f)),d);
+        dd=_mm256_sub_ps(_mm256_fmadd_ps(y2,d,_mm256_set1_ps(-0.251652398279877f)),dd);
+        d=_mm256_sub_ps(_mm256_fmadd_ps(y2,dd,_mm256_set1_ps(0.347342011478419f)),d);
+        t=_mm256_sub_ps(_mm256_fmadd_ps(y,d,_mm256_set1_ps(0.806857360076642f)),dd);
+        u=_mm256_fnmadd_ps(t,t,one);
+        t=_mm256_blendv_ps(t,one,sat);
+        u=_mm256_andnot_ps(sat,u);
+        _mm256_storeu_ps(f+i,_mm256_xor_ps(_mm256_mul_ps(scale,t),s));
+        _mm256_storeu_ps(g+i,_mm256_fmadd_ps(dscale,u,bias));
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static int activationavx512(const float* x, float* f, float* g, int n){
+    const __m512 zero=_mm512_setzero_ps();
+    const __m512 one=_mm512_set1_ps(1.0f);
+    const __m512 ten=_mm512_set1_ps(10.0f);
+    const __m512 scale=_mm512_set1_ps(1.732050807568877f);
+    const __m512 dscale=_mm512_set1_ps(1.14051899445142f);
+    const __m512 bias=_mm512_set1_ps(0.01f);
+    __m512 v,z,y,y2,d,dd,t,u;
+    __mmask16 neg,sat;
+    int i;
+    for(i=0; i+16<=n; i+=16){
+        v=_mm512_loadu_ps(x+i);
+        neg=_mm512_cmp_ps_mask(v,zero,_CMP_LT_OQ);
+        z=_mm512_mask_sub_ps(v,neg,zero,v);
+        sat=_mm512_cmp_ps_mask(z,ten,_CMP_GT_OQ);
+        z=_mm512_min_ps(z,ten);
+        y=_mm512_fmsub_ps(_mm512_set1_ps(0.2f),z,one);
+        y2=_mm512_add_ps(y,y);
+        dd=_mm512_set1_ps(0.00366079966971855f);
+        d=_mm512_fmadd_ps(y2,dd,_mm512_set1_ps(-0.00609954274163606f));
+        dd=_mm512_sub_ps(_mm512_fmadd_ps(y2,d,_mm512_set1_ps(0.00292879407703366f)),dd);
+        d=_mm512_sub_ps(_mm512_fmadd_ps(y2,dd,_mm512_set1_ps(0.0154392072571603f)),d);
+        dd=_mm512_sub_ps(_mm512_fmadd_ps(y2,d,_mm512_set1_ps(-0.0620003898943956f)),dd);
+        d=_mm512_sub_ps(_mm512_fmadd_ps(y2,dd,_mm512_set1_ps(0.144460219650769f)),d);
+        dd=_mm512_sub_ps(_mm512_fmadd_ps(y2,d,_mm512_set1_ps(-0.251652398279877f)),dd);
+        d=_mm512_sub_ps(_mm512_fmadd_ps(y2,dd,_mm512_set1_ps(0.347342011478419f)),d);
+        t=_mm512_sub_ps(_mm512_fmadd_ps(y,d,_mm512_set1_ps(0.806857360076642f)),dd);
+        u=_mm512_fnmadd_ps(t,t,one);
+        t=_mm512_mask_blend_ps(sat,t,one);
+        u=_mm512_mask_blend_ps(sat,u,zero);
+        t=_mm512_mul_ps(scale,t);
+        _mm512_storeu_ps(f+i,_mm512_mask_sub_ps(t,neg,zero,t));
+        _mm512_storeu_ps(g+i,_mm512_fmadd_ps(dscale,u,bias));
+    }
+    return i;
+}
+
+#endif /* HAVE_X86 */
+
+typedef void (*gatherfn_t)(float*, const float*, float**, sparse_t*, int);
+typedef void (*scatterfn_t)(float**, sparse_t*, float, const float*, int);
+typedef int (*activationfn_t)(const float*, float*, float*, int);
+typedef void (*gatherhalffn_t)(float*, const float*, uint16_t**, sparse_t*, int);
+typedef void (*scatterhalffn_t)(uint16_t**, sparse_t*, float, const float*, int, uint32_t*);
+
+static int activationnone(const float* x, float* f, float* g, int n){
+    (void)x; (void)f; (void)g; (void)n;
+    return 0;
+}
+
+static void gatherresolve(float* a, const float* b, float** W, sparse_t* v, int len);
+static void scatterresolve(float** W, sparse_t* v, float eta, const float* d, int len);
+
+static gatherfn_t gatherfn = gatherresolve;
+static scatterfn_t scatterfn = scatterresolve;
+static activationfn_t activationfn = activationnone;
+static gatherhalffn_t gatherhalffn = gatherhalfgeneric;
+static scatterhalffn_t scatterhalffn = scatterhalfgeneric;
+static const char* name = "generic";
+static int blasmin = KERNEL_BLAS_MIN;
+
+/* Pick the widest kernels the cpu supports. This runs on the
+ * first call; concurrent first calls store the same values.
+ */
+static void resolve(void){
+    gatherfn_t g = gathergeneric;
+    scatterfn_t s = scattergeneric;
+    activationfn_t a = activationnone;
+    gatherhalffn_t gh = gatherhalfgeneric;
+    scatterhalffn_t sh = scatterhalfgeneric;
+    name = "generic";
+    blasmin = KERNEL_BLAS_MIN;
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        g = gatheravx512;
+        s = scatteravx512;
+        a = activationavx512;
+        gh = gatherhalfavx512;
+        sh = scatterhalfavx512;
+        name = "avx512";
+        blasmin = INT_MAX;
+    }
+    else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        g = gatheravx2;
+        s = scatteravx2;
+        a = activationavx2;
+        gh = gatherhalfavx2;
+        sh = scatterhalfavx2;
+        name = "avx2";
+        blasmin = INT_MAX;
+    }
+#endif
+    activationfn = a;
+    gatherhalffn = gh;
+    scatterhalffn = sh;
+    gatherfn = g;
+    scatterfn = s;
+}
+
+static void gatherresolve(float* a, const float* b, float** W, sparse_t* v, int len){
+    resolve();
+    gatherfn(a,b,W,v,len);
+}
+
+static void scatterresolve(float** W, sparse_t* v, float eta, const float* d, int len){
+    resolve();
+    scatterfn(W,v,eta,d,len);
+}
+
+void sparsegather(float* a, const float* b, float** W, sparse_t* v, int len){
+    if(len>=blasmin)
+        gatherblas(a,b,W,v,len);
+    else
+        gatherfn(a,b,W,v,len);
+}
+
+void sparsescatter(float** W, sparse_t* v, float eta, const float* d, int len){
+    if(len>=blasmin)
+        scatterblas(W,v,eta,d,len);
+    else
+        scatterfn(W,v,eta,d,len);
+}
+
+void sparsegatherbf16(float* a, const float* b, uint16_t** W, sparse_t* v, int len){
+    if(gatherfn==gatherresolve)
+        resolve();
+    gatherhalffn(a,b,W,v,len);
+}
+
+void sparsescatterbf16(uint16_t** W, sparse_t* v, float eta, const float* d, int len, uint32_t* seed){
+    if(gatherfn==gatherresolve)
+        resolve();
+    scatterhalffn(W,v,eta,d,len,seed);
+}
+
+int activationsimd(const float* x, float* f, float* g, int n){
+    if(gatherfn==gatherresolve)
+        resolve();
+    return activationfn(x,f,g,n);
+}
+
+const char* kernelname(void){
+    if(gatherfn==gatherresolve)
+        resolve();
+    return name;
+}
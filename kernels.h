@@ -0,0 +1,56 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Declarations of the sparse kernels used by the neural net. *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dataset.h"
+
+/* When the cpu has no vector kernel, rows at least this long
+ * are handed to BLAS which beats the portable loops there.
+ * The AVX2 and AVX-512 kernels are faster than BLAS at every
+ * size we measured (up to 8192 hidden units).
+ */
+#define KERNEL_BLAS_MIN 1024
+
+/* a = b + sum_i v->x[i]*W[v->idx[i]], all vectors have len entries */
+void sparsegather(float* a, const float* b, float** W, sparse_t* v, int len);
+
+/* W[v->idx[i]] += eta*v->x[i]*d for every nonzero of v */
+void sparsescatter(float** W, sparse_t* v, float eta, const float* d, int len);
+
+/* The same for rows stored as bfloat16, the upper 16 bits of a
+ * float. Products are summed in float. The scatter rounds each
+ * updated weight stochastically, drawing from the xorshift state
+ * *seed, which must not be zero.
+ */
+void sparsegatherbf16(float* a, const float* b, uint16_t** W, sparse_t* v, int len);
+void sparsescatterbf16(uint16_t** W, sparse_t* v, float eta, const float* d, int len, uint32_t* seed);
+
+/* Conversions between float and bfloat16, rounding to nearest */
+void tobf16(uint16_t* dst, const float* src, size_t n);
+void frombf16(float* dst, const uint16_t* src, size_t n);
+
+/* The same as tobf16, rounding stochastically like the scatter */
+void tobf16random(uint16_t* dst, const float* src, size_t n, uint32_t* seed);
+
+/* w += a*x for a bfloat16 row w, rounding stochastically */
+void axpybf16(uint16_t* w, float a, const float* x, int len, uint32_t* seed);
+
+/* Vectorized activation function and derivative, see activation().
+ * Processes a prefix of the n values and returns its length. The
+ * results agree with the scalar code to within 1e-6 absolute.
+ */
+int activationsimd(const float* x, float* f, float* g, int n);
+
+/* Name of the kernel variant selected for this cpu */
+const char* kernelname(void);
+
+#endif /* KERNELS_H */
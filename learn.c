@@ -24,13 +24,18 @@ int catchfpe(){
 }
 #endif
 
+#include "cluster.h"
 #include "dataset.h"
 #include "metrics.h"
 #include "nnet.h"
+#include "stream.h"
+#include "telemetry.h"
 #include <getopt.h>
+#include <pthread.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 
@@ -44,40 +49,236 @@ void shuffle(int* a, int n){
     }
 }
 
+/* Everything needed to evaluate the network every period and
+ * keep the best models so far. With -a this runs on a thread of
+ * its own, on a snapshot of the weights, while training goes on.
+ */
+typedef struct report_t{
+    dataset_t* train; /* NULL when the training set is streamed */
+    dataset_t* stop;
+    float *pt,*ps; /* predictions on the two sets */
+    evaluator_t eval;
+    int threads;
+    int full; /* whether to evaluate the whole training set again */
+    best_t best; /* the best models so far */
+    /* Handoff to the evaluation thread */
+    nnet_t snap; /* copy of the weights to evaluate */
+    int pass; /* epoch of the snapshot, -1 if there is none */
+    int quit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}report_t;
+
+/* Evaluates n after epoch pass, prints one line and saves it to
+ * the files of the metrics that improved. The network is
+ * serialized once no matter how many files it goes to. Unless
+ * r->full is set, the training set metrics come from the
+ * predictions trainnet() recorded during the epoch.
+ */
+static void report(report_t* r, nnet_t* n, int pass){
+    metrics_t ms,mt;
+    char* image;
+    size_t len;
+    int i,improved;
+    TELEMETRY_TIMER(tick);
+
+    testnet(n, r->stop, r->ps, r->threads);
+    evaluate(&r->eval, r->ps, r->stop->target, r->stop->nex, &ms);
+    if(r->train==NULL)
+        printf("pass %d sacc %.5f srms %.5f sauc %.5f ",pass,ms.acc,ms.rms,ms.auc);
+    else{
+        if(r->full)
+            testnet(n, r->train, r->pt, r->threads);
+        evaluate(&r->eval, r->pt, r->train->target, r->train->nex, &mt);
+        printf("pass %d tacc %.5f sacc %.5f trms %.5f srms %.5f tauc %.5f sauc %.5f ",pass,mt.acc,ms.acc,mt.rms,ms.rms,mt.auc,ms.auc);
+    }
+    improved=improvebest(&r->best, &ms, NULL);
+    printf(improved&1 ? "( " : ") ");
+    printf(improved&2 ? "[ " : "] ");
+    printf(improved&4 ? "{ " : "} ");
+    printf("\n");
+    fflush(stdout);
+    TELEMETRY_LAP(TM_EVAL, tick);
+    if(improved){
+        len=packnet(n,&image);
+        for(i=0; i<3; i++)
+            if(improved&(1<<i))
+                writenet(r->best.file[i],image,len);
+        free(image);
+    }
+    TELEMETRY_LAP(TM_SAVE, tick);
+}
+
+/* The evaluation thread: reports every snapshot it is handed */
+static void* reporter(void* arg){
+    report_t* r=(report_t*)arg;
+    pthread_mutex_lock(&r->lock);
+    for(;;){
+        while(r->pass<0 && !r->quit)
+            pthread_cond_wait(&r->cond,&r->lock);
+        if(r->pass<0)
+            break;
+        pthread_mutex_unlock(&r->lock);
+        report(r,&r->snap,r->pass);
+        TELEMETRY_FLUSH();
+        pthread_mutex_lock(&r->lock);
+        r->pass=-1;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* Hands a copy of n to the evaluation thread, along with the
+ * predictions pv recorded during the epoch. If it is still busy
+ * with the previous snapshot, training waits for it, so there is
+ * never more than one copy of the weights.
+ */
+static void handoff(report_t* r, nnet_t* n, const float* pv, int pass){
+    pthread_mutex_lock(&r->lock);
+    while(r->pass>=0)
+        pthread_cond_wait(&r->cond,&r->lock);
+    copynet(&r->snap,n);
+    if(pv!=NULL)
+        memcpy(r->pt,pv,sizeof(float)*r->train->nex);
+    r->pass=pass;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
 int main(int argc, char* argv[]){
     nnet_t n;
-    dataset_t train,stop;
-    float *pt,*ps;
-    float at,as,et,es,rt,rs;
-    float maxacc=0;
-    float maxauc=0;
-    float minrms=2;
+    dataset_t train,stop,shard,shuffled;
+    cluster_t cluster;
+    report_t r;
+    float *pv;
     float rate=0.05;
-    int *perm;
+    int rateset=0;
+    int optimizer=-1;
+    char* resume=NULL;
+    int *perm,*seq;
+    float *pc;
     int epochs=1000;
     int hidden=16;
+    int members=1;
     int period=10;
+    int threads=1;
+    int stream=0;
+    int bits=0;
+    int hashsign=0;
+    int compact=0;
+    int batch=1;
+    int aucbits=0;
+    int async=0;
+    int full=0;
+    char* address=NULL;
+    int rank=0;
+    int workers=1;
+    int every=0;
+    int half=0;
+    int rounds=1;
+    FILE* json=NULL;
+    uint64_t start;
+    long begin,end;
+    int j;
+    float l2=0;
+    float l1=0;
+    int* dict=NULL;
+    int* order=NULL;
+    int reorder=0;
+    int copy=0;
+    int maxline=0;
+    FILE* fp;
     int option;
     int i;
     char* prefix;
-    char modelacc[1024];
-    char modelrms[1024];
-    char modelauc[1024];
+    TELEMETRY_TIMER(tick);
 
     const char* help="Usage: %s [options] trainingset validationset model\nAvailable options:\n\
+            -A <int>  : approximate the AUC with a histogram of 2^bits bins (default: exact)\n\
+            -a        : evaluate and save the network on a separate thread while training goes on\n\
+            -B <int>  : number of examples per training step (default: 1)\n\
+            -b <int>  : hash the features into 2^bits inputs (default: no hashing)\n\
+            -C        : copy the examples into shuffled order every epoch, so training\n\
+                        reads them sequentially (needs memory for a second copy)\n\
+            -c        : give rows only to the features that occur in the training set\n\
+            -E <int>  : with -M, average the workers every so many examples per worker (default: once per epoch)\n\
             -e <int>  : number of epochs (default: 1000)\n\
+            -f        : evaluate the whole training set after each period instead of\n\
+                        using the predictions made during training\n\
+            -g <name> : optimizer: sgd, adagrad or rmsprop (default: sgd, or the one\n\
+                        of the model with -i)\n\
             -h <int>  : number of hidden units (default: 16)\n\
+            -i <file> : resume training the network in file; its layers, features\n\
+                        and learning rate are kept unless -r or -g changes them\n\
+            -j <file> : append one line of JSON per epoch with timings and throughput\n\
+                        to file (needs a build with make telemetry=1)\n\
+            -K <int>  : train an ensemble of so many networks that share the pass over\n\
+                        each example; the model outputs their average (default: 1)\n\
+            -l <float>: L2 regularization (default: 0)\n\
+            -L <float>: L1 regularization (default: 0)\n\
+            -M <int>  : number of worker processes training together (default: 1)\n\
+            -o        : like -c, but number the features by decreasing frequency so\n\
+                        the rows of the most frequent ones are next to each other\n\
             -p <int>  : print performance every so many epochs: (default: 10)\n\
-            -r <float>: learning rate (default: 0.05)\n";
+            -q        : store the first layer weights as bfloat16, half the memory of floats\n\
+            -R <int>  : rank of this worker, from 0 to M-1; rank 0 evaluates and saves (default: 0)\n\
+            -r <float>: learning rate, per epoch for sgd and per step for adagrad\n\
+                        and rmsprop (default: 0.05)\n\
+            -s <int>  : stream the training set through a shuffle buffer of this many examples\n\
+            -t <int>  : number of threads for training and evaluation (default: 1)\n\
+            -W <addr> : with -M, where the workers meet: unix:path or host:port\n\
+            -x        : with -b, also hash the sign of each feature\n";
 
     assert(catchfpe());
+    start=telemetryclock();
 
-    while((option=getopt(argc,argv,"e:h:p:r:"))!=EOF){
+    while((option=getopt(argc,argv,"aA:B:b:CcE:e:fg:h:i:j:K:l:L:M:op:qR:r:s:t:W:x"))!=EOF){
         switch(option){
+            case 'a': async=1; break;
+            case 'A': aucbits=atoi(optarg); break;
+            case 'B': batch=atoi(optarg); break;
+            case 'b': bits=atoi(optarg); break;
+            case 'C': copy=1; break;
+            case 'c': compact=1; break;
+            case 'E': every=atoi(optarg); break;
             case 'e': epochs=atoi(optarg); break;
+            case 'f': full=1; break;
+            case 'g':
+                if(strcmp(optarg,"sgd")==0)
+                    optimizer=OPT_SGD;
+                else if(strcmp(optarg,"adagrad")==0)
+                    optimizer=OPT_ADAGRAD;
+                else if(strcmp(optarg,"rmsprop")==0)
+                    optimizer=OPT_RMSPROP;
+                else{
+                    fprintf(stderr,"Unknown optimizer %s\n",optarg);
+                    exit(1);
+                }
+                break;
             case 'h': hidden=atoi(optarg); break;
+            case 'i': resume=optarg; break;
+            case 'K': members=atoi(optarg); break;
+            case 'j':
+                json=fopen(optarg,"a");
+                if(json==NULL){
+                    fprintf(stderr,"Could not open file %s\n",optarg);
+                    exit(1);
+                }
+                break;
+            case 'l': l2=atof(optarg); break;
+            case 'L': l1=atof(optarg); break;
+            case 'M': workers=atoi(optarg); break;
+            case 'o': compact=1; reorder=1; break;
             case 'p': period=atoi(optarg); break;
-            case 'r': rate=atof(optarg); break;
+            case 'q': half=1; break;
+            case 'R': rank=atoi(optarg); break;
+            case 'r': rate=atof(optarg); rateset=1; break;
+            case 's': stream=atoi(optarg); break;
+            case 't': threads=atoi(optarg); break;
+            case 'W': address=optarg; break;
+            case 'x': hashsign=1; break;
             case '?': fprintf(stderr,help,argv[0]); exit(1); break;
         }
     }
@@ -86,70 +287,277 @@ int main(int argc, char* argv[]){
         fprintf(stderr,help,argv[0]);
         exit(1);
     }
+    if(bits<0 || bits>30){
+        fprintf(stderr,"The number of hash bits must be between 0 (no hashing) and 30\n");
+        exit(1);
+    }
+    if(aucbits<0 || aucbits>24){
+        fprintf(stderr,"The number of histogram bits must be between 0 (exact) and 24\n");
+        exit(1);
+    }
+    if(batch<1){
+        fprintf(stderr,"The batch size must be at least 1\n");
+        exit(1);
+    }
+    if(members<1 || (members>1 && batch>1)){
+        fprintf(stderr,"The ensemble needs at least 1 member and cannot be combined with -B\n");
+        exit(1);
+    }
+    if(workers<1 || rank<0 || rank>=workers || every<0){
+        fprintf(stderr,"The rank must be between 0 and the number of workers minus one\n");
+        exit(1);
+    }
+    if(workers>1 && (address==NULL || stream>0 || half)){
+        fprintf(stderr,"Option -M needs -W and cannot be combined with -s or -q\n");
+        exit(1);
+    }
+#ifndef TELEMETRY
+    if(json!=NULL){
+        fprintf(stderr,"Option -j needs nnlearn built with make telemetry=1\n");
+        exit(1);
+    }
+#endif
+    if(copy && stream>0){
+        fprintf(stderr,"Option -C cannot be combined with -s\n");
+        exit(1);
+    }
+    if(compact && (bits>0 || stream>0)){
+        fprintf(stderr,"Options -c and -o cannot be combined with -b or -s\n");
+        exit(1);
+    }
+    if(resume!=NULL && (bits>0 || compact)){
+        fprintf(stderr,"Option -i takes the features from the model and cannot be combined with -b, -c or -o\n");
+        exit(1);
+    }
 
-    loadData(argv[optind], &train);
-    loadData(argv[optind+1], &stop);
-    pt=malloc(sizeof(float)*train.nex);
-    ps=malloc(sizeof(float)*stop.nex);
-    perm=malloc(sizeof(int)*train.nex);
-    for(i=0; i<train.nex; i++){
-        perm[i]=i;
+    if(stream>0){
+        /* Only the dimensions of the training set are kept */
+        fp=fopen(argv[optind],"r");
+        if(fp==NULL){
+            fprintf(stderr,"Could not open file %s\n",argv[optind]);
+            exit(1);
+        }
+        maxline=scanData(fp, &train);
+        fclose(fp);
+        r.pt=NULL;
+    }
+    else{
+        loadData(argv[optind], &train);
+        r.pt=malloc(sizeof(float)*train.nex);
+    }
+    if(resume!=NULL){
+        loadnet(resume, &n);
+        if((n.members>1 && batch>1) || (workers>1 && n.precision==PRECISION_BF16)){
+            fprintf(stderr,"The network in %s cannot be trained with -B or -M\n",resume);
+            exit(1);
+        }
+        /* The streamed examples are prepared as they are read */
+        if(stream==0){
+            writableData(&train);
+            prepvectors(&n, train.example, train.nex);
+        }
+        train.nfeat=n.inputs;
+    }
+    if(bits>0){
+        /* The number of inputs is set by the hash, not by the largest feature */
+        if(stream==0){
+            writableData(&train);
+            hashvectors(bits, hashsign, train.example, train.nex);
+        }
+        train.sparsity*=train.nfeat/(float)(1<<bits);
+        train.nfeat=1<<bits;
+    }
+    if(compact){
+        writableData(&train);
+        i=compactvectors(train.example, train.nex, &dict, reorder ? &order : NULL);
+        train.sparsity*=train.nfeat/(float)i;
+        train.nfeat=i;
+    }
+    /* Every worker trains on its own contiguous part of the
+     * training set. All of them load and prepare the whole set
+     * so that hashing and compaction agree, and rank 0 needs it
+     * for evaluation. The predictions made during training only
+     * cover a part, so the training set is evaluated in full.
+     */
+    shard=train;
+    if(workers>1){
+        begin=(long)train.nex*rank/workers;
+        end=(long)train.nex*(rank+1)/workers;
+        shard.example+=begin;
+        shard.target+=begin;
+        shard.nex=end-begin;
+        shard.map=NULL;
+        /* All workers must average the same number of times */
+        if(every>0)
+            rounds=((train.nex+workers-1)/workers+every-1)/every;
+        full=1;
+    }
+    if(stream>0)
+        perm=NULL;
+    else{
+        perm=malloc(sizeof(int)*shard.nex);
+        for(i=0; i<shard.nex; i++){
+            perm[i]=i;
+        }
+    }
+    /* With -C each epoch trains on a shuffled copy in order */
+    memset(&shuffled,0,sizeof(shuffled));
+    seq=NULL;
+    if(copy){
+        seq=malloc(sizeof(int)*shard.nex);
+        for(i=0; i<shard.nex; i++)
+            seq[i]=i;
     }
+    loadData(argv[optind+1], &stop);
+    r.ps=malloc(sizeof(float)*stop.nex);
 
     prefix = argv[optind+2];
-    sprintf(modelacc,"%s.acc",prefix);
-    sprintf(modelrms,"%s.rms",prefix);
-    sprintf(modelauc,"%s.auc",prefix);
+    initbest(&r.best, prefix);
 
-    srand(time(0));
-    clipvectors(train.nfeat, stop.example, stop.nex);
-    rate/=train.nex;
+    srand(time(0)+rank);
+    if(optimizer<0)
+        optimizer = resume!=NULL ? n.optimizer : OPT_SGD;
+    /* SGD steps by rate/n, so that rate is on the scale of an
+     * epoch. The adaptive optimizers take rate as the step itself,
+     * and l2 and l1 are divided by n instead: the decay per step
+     * is rate*l2/n with every optimizer, and an epoch shrinks the
+     * weights by about exp(-rate*l2) whichever one is used.
+     * Relative to the per-step rate of adagrad and rmsprop the
+     * regularization is thus l2/n and l1/n.
+     */
+    if(optimizer==OPT_SGD)
+        rate/=train.nex;
+    else{
+        l2/=train.nex;
+        l1/=train.nex;
+    }
 
-    maxacc=0;
-    maxauc=0;
-    minrms=2;
+    r.train = stream>0 ? NULL : &train;
+    r.stop=&stop;
+    r.threads=threads;
+    r.full=full;
+    /* Where trainnet() records its predictions. The evaluation
+     * thread gets a copy, so training can go on writing them.
+     */
+    if(stream>0 || full)
+        pv=NULL;
+    else if(async)
+        pv=malloc(sizeof(float)*train.nex);
+    else
+        pv=r.pt;
+    /* Predictions on the copy, in the order of the copy */
+    pc = copy && pv!=NULL ? malloc(sizeof(float)*train.nex) : NULL;
 
-    createnet(&n, &train, hidden, rate);
+    if(resume==NULL){
+        createnet_r(&n, &train, hidden, members, rate, rand());
+        n.hashbits=bits;
+        n.hashsign=hashsign;
+        n.dict=dict;
+        n.order=order;
+    }
+    else if(rateset || optimizer!=n.optimizer)
+        n.eta=rate;
+    n.batch=batch;
+    adaptnet(&n, optimizer);
+    if(half)
+        quantizenet(&n, PRECISION_BF16);
+    if(workers>1){
+        /* Each worker decays the weights for its own examples only */
+        l2*=workers;
+        l1*=workers;
+    }
+    if(l2>0 || l1>0)
+        regularize(&n, l2, l1);
+    if(workers>1){
+        joincluster(&cluster, address, rank, workers);
+        broadcastnet(&cluster, &n);
+    }
+    writableData(&stop);
+    prepvectors(&n, stop.example, stop.nex);
+    initevaluator(&r.eval, aucbits);
+    if(async && rank==0){
+        memset(&r.snap,0,sizeof(r.snap));
+        r.pass=-1;
+        r.quit=0;
+        pthread_mutex_init(&r.lock,NULL);
+        pthread_cond_init(&r.cond,NULL);
+        pthread_create(&r.thread,NULL,reporter,&r);
+    }
+    TELEMETRY_RESTART(tick);
     for(i=0; i<epochs; i++){
-        shuffle(perm,train.nex);
-        trainnet(&n, &train, perm);
-        if(i % period == 0){
-            testnet(&n, &train, pt);
-            testnet(&n, &stop, ps);
-            at=acc(pt, train.target, train.nex);
-            et=rms(pt, train.target, train.nex);
-            rt=auc(pt, train.target, train.nex);
-            as=acc(ps, stop.target, stop.nex);
-            es=rms(ps, stop.target, stop.nex);
-            rs=auc(ps, stop.target, stop.nex);
-            printf("pass %d tacc %.5f sacc %.5f trms %.5f srms %.5f tauc %.5f sauc %.5f ",i,at,as,et,es,rt,rs);
-            if(as>maxacc){
-                printf("( ");
-                maxacc=as;
-                savenet(modelacc,&n);
-            }
-            else
-                printf(") ");
-            if(es<minrms){
-                printf("[ ");
-                minrms=es;
-                savenet(modelrms,&n);
+        if(stream>0)
+            trainstream(&n, argv[optind], maxline, stream);
+        else if(workers>1){
+            shuffle(perm,shard.nex);
+            if(copy)
+                permuteData(&shard, perm, shard.nex, &shuffled);
+            TELEMETRY_LAP(TM_SHUFFLE, tick);
+            for(j=0; j<rounds; j++){
+                begin=(long)shard.nex*j/rounds;
+                end=(long)shard.nex*(j+1)/rounds;
+                if(copy)
+                    trainpart(&n, &shuffled, seq+begin, end-begin, NULL, threads);
+                else
+                    trainpart(&n, &shard, perm+begin, end-begin, NULL, threads);
+                averagenet(&cluster, &n);
             }
-            else
-                printf("] ");
-            if(rs>maxauc){
-                printf("{ ");
-                maxauc=rs;
-                savenet(modelauc,&n);
+        }
+        else if(copy){
+            shuffle(perm,train.nex);
+            permuteData(&train, perm, train.nex, &shuffled);
+            TELEMETRY_LAP(TM_SHUFFLE, tick);
+            trainnet(&n, &shuffled, seq, pc, threads);
+            if(pv!=NULL){
+                for(j=0; j<train.nex; j++)
+                    pv[perm[j]]=pc[j];
             }
+        }
+        else{
+            shuffle(perm,train.nex);
+            TELEMETRY_LAP(TM_SHUFFLE, tick);
+            trainnet(&n, &train, perm, pv, threads);
+        }
+        TELEMETRY_LAP(TM_TRAIN, tick);
+        if(i % period == 0 && rank==0){
+            flushnet(&n);
+            if(async)
+                handoff(&r,&n,pv,i);
             else
-                printf("} ");
-            printf("\n");
+                report(&r,&n,i);
+        }
+        if(json!=NULL){
+            /* The first line also covers loading the data */
+            telemetrywrite(json, i, (telemetryclock()-start)*1e-9);
+            start=telemetryclock();
         }
+        TELEMETRY_RESTART(tick);
+    }
+    if(json!=NULL)
+        fclose(json);
+    if(workers>1)
+        leavecluster(&cluster);
+    if(async && rank==0){
+        pthread_mutex_lock(&r.lock);
+        r.quit=1;
+        pthread_cond_broadcast(&r.cond);
+        pthread_mutex_unlock(&r.lock);
+        pthread_join(r.thread,NULL);
+        pthread_mutex_destroy(&r.lock);
+        pthread_cond_destroy(&r.cond);
+        if(r.snap.W1!=NULL || r.snap.H1!=NULL)
+            destroynet(&r.snap);
+        free(pv);
     }
-    free(ps);
-    free(pt);
-    freeData(&train);
+    destroyevaluator(&r.eval);
+    free(r.ps);
+    free(r.pt);
+    free(perm);
+    free(seq);
+    free(pc);
+    if(copy)
+        freeData(&shuffled);
+    if(stream==0)
+        freeData(&train);
     freeData(&stop);
     destroynet(&n);
     return 0;
@@ -8,165 +8,245 @@
  
 #include "metrics.h"
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-static int partition(int p, int r, float *pred, int *target)
+/* The radix sort looks at the 32 bits of the key in three digits
+ * of 11, 11 and 10 bits, starting from the most significant one.
+ */
+#define RADIX_SIZE 2048
+static const int radixshift[3] = {21, 10, 0};
+
+static int digit(uint32_t key, int d)
+{
+    return (key >> radixshift[d]) & (RADIX_SIZE - 1);
+}
+
+void initevaluator(evaluator_t* e, int bits)
+{
+    e->bits = bits;
+    e->size = 0;
+    e->key = NULL;
+    e->tmp = NULL;
+    e->count = bits>0 ? malloc(sizeof(long)*2*((size_t)1<<bits)) : NULL;
+}
+
+void destroyevaluator(evaluator_t* e)
+{
+    free(e->key);
+    free(e->tmp);
+    free(e->count);
+}
+
+/* Maps a float to an unsigned integer with the same order.
+ * -0 and +0 get the same key so that they form one tie group.
+ */
+static uint32_t floatkey(float f)
 {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    /* In integers, since -ffast-math may drop a float f += 0 */
+    if ((u << 1) == 0)
+        u = 0;
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+/* Area under the ROC curve from the predictions sorted by
+ * increasing value. Tied predictions count as half right,
+ * the same as a straight segment through the tie group.
+ */
+static double sortedauc(const uint64_t* key, int n, long pos, long neg)
+{
+    double area = 0;
+    long below = 0;
+    long p, q;
     int i, j;
-    float x, tempf;
-    int tempi;
-
-    x = pred[p];
-    i = p - 1;
-    j = r + 1;
-    while (1) {
-        do
-            j--;
-        while (!(pred[j] <= x));
-        do
-            i++;
-        while (!(pred[i] >= x));
-        if (i < j) {
-            tempf = pred[i];
-            pred[i] = pred[j];
-            pred[j] = tempf;
-            tempi = target[i];
-            target[i] = target[j];
-            target[j] = tempi;
-        } else
-            return (j);
+
+    for (i = 0; i < n; i = j) {
+        p = q = 0;
+        for (j = i; j < n && (key[j] >> 32) == (key[i] >> 32); j++) {
+            if (key[j] & 1)
+                p++;
+            else
+                q++;
+        }
+        area += p * (below + 0.5 * q);
+        below += q;
     }
+    return area / ((double) pos * neg);
 }
 
-
-static void quicksort(int p, int r, float *pred, int *target)
+/* Accuracy and root mean squared error, in a single pass with
+ * no buffers. The predictions are thresholded at 0 when some
+ * target is negative and at 0.5 otherwise.
+ */
+static void pointwise(const float* predictions, const int* targets, int n, metrics_t* m)
 {
-    int q;
-    if (p < r) {
-        q = partition(p, r, pred, target);
-        quicksort(p, q, pred, target);
-        quicksort(q + 1, r, pred, target);
+    double sq, diff, hits0, hits5;
+    int signedtargets, i;
+
+    signedtargets = 0;
+    hits0 = hits5 = sq = 0;
+    for (i = 0; i < n; i++) {
+        diff = predictions[i] - targets[i];
+        sq += diff * diff;
+        if (predictions[i] * targets[i] > 0)
+            hits0 += 1;
+        if ((predictions[i] - 0.5f) * (targets[i] - 0.5f) > 0)
+            hits5 += 1;
+        if (targets[i] < 0)
+            signedtargets = 1;
     }
+    m->acc = (signedtargets ? hits0 : hits5) / n;
+    m->rms = sqrt(sq / n);
 }
 
-float auc(float *predictions, int *targets, int n)
+/* Computes accuracy, root mean squared error and AUC. For the
+ * AUC the predictions are radix sorted, or with e->bits>0 counted in a histogram over
+ * the leading bits of their keys. Predictions that share a bin
+ * count as tied, which changes the AUC by at most half the
+ * fraction of pairs of examples that fall in the same bin.
+ */
+void evaluate(evaluator_t* e, const float* predictions, const int* targets, int n, metrics_t* m)
 {
-    int i;
-    int item = 0;
-    int no_item = n;
-    int total_true_1 = 0;
-    int total_true_0 = 0;
-    float *pred = malloc(no_item*sizeof(float));
-    float *fraction = malloc(no_item*sizeof(float));
-    int *target = malloc(no_item*sizeof(int));
-    double tt, tf, ft, ff;
-    double sens, spec, tpf, fpf, tpf_prev, fpf_prev;
-    double roc_area;
-
-    float threshold = 0;
-    for (i = 0; i < no_item; i++) {
-        threshold += targets[i];
+    size_t hist[3][RADIX_SIZE];
+    uint64_t *src, *dst, *swap;
+    double sum;
+    long pos, neg, b, nbins;
+    size_t total, c;
+    uint32_t key;
+    int i, d, label;
+
+    pointwise(predictions, targets, n, m);
+    sum = 0;
+    for (i = 0; i < n; i++)
+        sum += targets[i];
+    /* Targets above the mean are the positive class of the AUC */
+    sum = sum / n;
+
+    if (e->bits == 0 && e->size < n) {
+        e->size = n;
+        e->key = realloc(e->key, sizeof(uint64_t) * n);
+        e->tmp = realloc(e->tmp, sizeof(uint64_t) * n);
     }
-    threshold = threshold / no_item;
-
-    for (i = 0; i < no_item; i++) {
-        if (targets[i] > threshold) {
-            target[i] = 1;
-            total_true_1++;
-        } else {
-            target[i] = 0;
-            total_true_0++;
+    nbins = (long)1 << e->bits;
+    if (e->bits > 0)
+        memset(e->count, 0, sizeof(long) * 2 * nbins);
+    else
+        memset(hist, 0, sizeof(hist));
+
+    pos = neg = 0;
+    for (i = 0; i < n; i++) {
+        label = targets[i] > sum;
+        pos += label;
+        key = floatkey(predictions[i]);
+        if (e->bits > 0)
+            e->count[2 * (key >> (32 - e->bits)) + label] += 1;
+        else {
+            e->key[i] = ((uint64_t) key << 32) | label;
+            for (d = 0; d < 3; d++)
+                hist[d][digit(key, d)]++;
         }
-        pred[i] = predictions[i];
     }
-
-    quicksort(0, (no_item - 1), pred, target);
-
-    while (item < no_item) {
-        int begin = item;
-        int count = 1;
-        int no_poz;
-        if (target[item] == 1)
-            no_poz = 1;
-        else
-            no_poz = 0;
-        while ((item < no_item - 1) && (fabs(pred[item] - pred[item + 1]) < 1e-15)) {
-            item++;
-            count++;
-            if (target[item] == 1)
-                no_poz++;
+    neg = n - pos;
+
+    if (pos == 0 || neg == 0)
+        /* A single class has no ranking to measure */
+        m->auc = 0.5;
+    else if (e->bits > 0) {
+        double area = 0;
+        long below = 0;
+        for (b = 0; b < nbins; b++) {
+            area += e->count[2 * b + 1] * (below + 0.5 * e->count[2 * b]);
+            below += e->count[2 * b];
         }
-        for (i = begin; i <= item; ++i)
-            fraction[i] = no_poz * 1.0 / count;
-        item++;
+        m->auc = area / ((double) pos * neg);
     }
+    else {
+        /* Least significant digit first, each pass is stable */
+        src = e->key;
+        dst = e->tmp;
+        for (d = 2; d >= 0; d--) {
+            total = 0;
+            for (b = 0; b < RADIX_SIZE; b++) {
+                c = hist[d][b];
+                hist[d][b] = total;
+                total += c;
+            }
+            for (i = 0; i < n; i++)
+                dst[hist[d][digit(src[i] >> 32, d)]++] = src[i];
+            swap = src;
+            src = dst;
+            dst = swap;
+        }
+        m->auc = sortedauc(src, n, pos, neg);
+    }
+}
 
-
-    tt = 0;
-    tf = total_true_1;
-    ft = 0;
-    ff = total_true_0;
-
-    sens = ((double) tt) / ((double) (tt + tf));
-    spec = ((double) ff) / ((double) (ft + ff));
-    tpf = sens;
-    fpf = 1.0 - spec;
-    roc_area = 0.0;
-    tpf_prev = tpf;
-    fpf_prev = fpf;
-
-    for (item = no_item - 1; item > -1; item--) {
-        tt += fraction[item];
-        tf -= fraction[item];
-        ft += 1 - fraction[item];
-        ff -= 1 - fraction[item];
-        sens = ((double) tt) / ((double) (tt + tf));
-        spec = ((double) ff) / ((double) (ft + ff));
-        tpf = sens;
-        fpf = 1.0 - spec;
-        roc_area += 0.5 * (tpf + tpf_prev) * (fpf - fpf_prev);
-        tpf_prev = tpf;
-        fpf_prev = fpf;
+void initbest(best_t* b, const char* prefix)
+{
+    static const char* suffix[3] = {"acc", "rms", "auc"};
+    int k;
+
+    b->value[0] = 0;
+    b->value[1] = 2;
+    b->value[2] = 0;
+    for (k = 0; k < 3; k++) {
+        b->seen[k] = 0;
+        snprintf(b->file[k], sizeof(b->file[k]), "%s.%s", prefix, suffix[k]);
     }
-    return roc_area;
 }
 
-float rms(float *predictions, int *targets, int n)
+/* Records the metrics m of a network. Returns a mask with bit k
+ * set for each metric k in which it beats every network so far;
+ * its file should get the network. If seen is not NULL it gets
+ * b->seen after the update, to tell later whether a better
+ * network came along meanwhile.
+ */
+int improvebest(best_t* b, const metrics_t* m, long* seen)
 {
+    int better[3];
+    int k, improved = 0;
+
+    better[0] = m->acc > b->value[0];
+    better[1] = m->rms < b->value[1];
+    better[2] = m->auc > b->value[2];
+    for (k = 0; k < 3; k++) {
+        if (better[k]) {
+            b->value[k] = k == 0 ? m->acc : k == 1 ? m->rms : m->auc;
+            b->seen[k] += 1;
+            improved |= 1 << k;
+        }
+        if (seen != NULL)
+            seen[k] = b->seen[k];
+    }
+    return improved;
+}
 
-    int i;
-    int no_item = n;
-    float rms,diff;
+float auc(float *predictions, int *targets, int n)
+{
+    evaluator_t e;
+    metrics_t m;
 
-    rms=0.0;
+    initevaluator(&e, 0);
+    evaluate(&e, predictions, targets, n, &m);
+    destroyevaluator(&e);
+    return m.auc;
+}
 
-    for (i = 0; i < no_item; i++) {
-        diff=(predictions[i]-targets[i]);
-        rms+=diff*diff;
-    }
-    rms=sqrtf(rms/no_item);
+float rms(float *predictions, int *targets, int n)
+{
+    metrics_t m;
 
-    return rms;
+    pointwise(predictions, targets, n, &m);
+    return m.rms;
 }
 
 float acc(float *predictions, int *targets, int n)
 {
-    int i;
-    int no_item = n;
-    float threshold = 0.5;
-    float acc;
-    for (i = 0; i < no_item; i++) {
-        if(targets[i]<0){
-            threshold=0.0;
-            break;
-        }
-    }
+    metrics_t m;
 
-    acc=0.0;
-    for(i = 0; i < no_item; i++){
-        if((predictions[i]-threshold)*(targets[i]-threshold) > 0)
-            acc+=1.0;
-    }
-    acc=acc/no_item;
-    return acc;
+    pointwise(predictions, targets, n, &m);
+    return m.acc;
 }
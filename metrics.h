@@ -8,6 +8,42 @@
 #ifndef METRICS_H
 #define METRICS_H
 
+#include <stdint.h>
+
+/* The three metrics reported for a set of predictions */
+typedef struct metrics_t{
+    float acc;
+    float rms;
+    float auc;
+}metrics_t;
+
+/* Working memory for evaluate(), reused from call to call.
+ * With bits>0 the AUC comes from a histogram of 2^bits bins
+ * instead of a sort, see evaluate().
+ */
+typedef struct evaluator_t{
+    int bits;       /* histogram resolution, 0 for the exact AUC */
+    int size;       /* number of predictions the buffers can hold */
+    uint64_t* key;  /* sort keys with the label in the lowest bit */
+    uint64_t* tmp;  /* second buffer of the radix sort */
+    long* count;    /* histogram: negatives and positives per bin */
+}evaluator_t;
+
+/* The best value of each metric so far, in the order acc, rms,
+ * auc, and the files that keep the networks that reached them.
+ * seen counts how often each one improved.
+ */
+typedef struct best_t{
+    float value[3];
+    long seen[3];
+    char file[3][1024];
+}best_t;
+
+void initevaluator(evaluator_t* e, int bits);
+void destroyevaluator(evaluator_t* e);
+void evaluate(evaluator_t* e, const float* predictions, const int* targets, int n, metrics_t* m);
+void initbest(best_t* b, const char* prefix);
+int improvebest(best_t* b, const metrics_t* m, long* seen);
 
 float acc(float *predictions, int *targets, int n);
 float rms(float *predictions, int *targets, int n);
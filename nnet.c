@@ -8,14 +8,26 @@
  
 #include "dataset.h"
 #include "nnet.h"
+#include "kernels.h"
+#include "telemetry.h"
 #include <cblas.h>
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void setrows(nnet_t* n, float* base);
+static void sethalfrows(nnet_t* n, uint16_t* base);
 
 /* generate a random value in the interval [-x,x] */  
-float symrand(float x){
-    return 2.0f*x*rand()/(RAND_MAX+1.0f)-x;
+static float symrand(float x, unsigned int* seed){
+    return 2.0f*x*rand_r(seed)/(RAND_MAX+1.0f)-x;
 }
 
 /* Create a neural network with enough inputs to handle the
@@ -23,11 +35,22 @@ float symrand(float x){
  * equal to rate. Store the network in n 
  */ 
 void createnet(nnet_t* n, dataset_t* d, int hid, float rate){
+    createnet_r(n, d, hid, 1, rate, rand());
+}
+
+/* The same with initial weights drawn from their own random
+ * sequence, so networks created at the same time by different
+ * threads do not depend on each other or on rand(). With more
+ * than one member, n is an ensemble of that many networks of
+ * hid hidden units each, see nnet_t.
+ */
+void createnet_r(nnet_t* n, dataset_t* d, int hid, int members, float rate, unsigned int seed){
     int i;
     float q,r;
 
     n->inputs=d->nfeat;
-    n->hidden=hid;
+    n->hidden=hid*members;
+    n->members=members;
 
     /* These choices are loosely based on the 
      * efficient backprop paper by LeCun et. al. 
@@ -36,92 +59,613 @@ void createnet(nnet_t* n, dataset_t* d, int hid, float rate){
     r=sqrtf(0.003f/(hid+1.0f));
 
     /* We store W1 in transposed form */
-    n->W1 = malloc(sizeof(float*)*n->inputs);
-    n->W1[0] = malloc(sizeof(float)*n->inputs*n->hidden);
-    for(i=1; i<n->inputs; i++)
-        n->W1[i]=n->W1[0]+i*n->hidden;
+    setrows(n,malloc(sizeof(float)*(size_t)n->inputs*n->hidden));
+    n->H1=NULL;
+    n->precision=PRECISION_FLOAT;
+    n->map=NULL;
+    n->maplen=0;
+    n->hashbits=0;
+    n->hashsign=0;
+    n->dict=NULL;
+    n->order=NULL;
+    n->l2=0.0f;
+    n->l1=0.0f;
+    n->step=0;
+    n->last=NULL;
+    n->decay=NULL;
+    n->batch=1;
+    n->optimizer=OPT_SGD;
+    n->accum=NULL;
 
     n->b1 = malloc(sizeof(float)*n->hidden);
-    n->a1 = malloc(sizeof(float)*n->hidden);
-    n->x1 = malloc(sizeof(float)*n->hidden);
-    n->g1 = malloc(sizeof(float)*n->hidden);
-    n->d1 = malloc(sizeof(float)*n->hidden);
     n->W2 = malloc(sizeof(float)*n->hidden);
+    n->b2 = malloc(sizeof(float)*members);
     n->eta = rate;
     for(i=0; i<n->inputs*n->hidden; i++){
-        n->W1[0][i] = symrand(q);
+        n->W1[0][i] = symrand(q,&seed);
     }
     for(i=0; i<n->hidden; i++){
-        n->b1[i] = symrand(q); 
-        n->W2[i] = symrand(r); 
+        n->b1[i] = symrand(q,&seed); 
+        n->W2[i] = symrand(r,&seed); 
     }
-    n->b2 = symrand(r);
+    for(i=0; i<members; i++)
+        n->b2[i] = symrand(r,&seed);
 }
 
-/* Saves the network n to a file */
-void savenet(const char* name, nnet_t* n){
+/* Binary network format. A fixed header is followed by the
+ * weights; every array starts at a multiple of NET_ALIGN bytes
+ * so a mapped file can be used in place. The endian field holds
+ * NET_ENDIAN as the writer stored it, so files from machines with
+ * a different byte order are recognized and refused. Networks
+ * saved by versions before this format have a text header, see
+ * loadtext().
+ */
+#define NET_MAGIC "SPNNMODL"
+#define NET_VERSION 1
+#define NET_ENDIAN 0x01020304u
+#define NET_ALIGN 64
+
+typedef struct netheader_t{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    int32_t inputs;
+    int32_t hidden; /* of all members together */
+    int32_t members;
+    int32_t precision; /* element type of W1, PRECISION_FLOAT or PRECISION_BF16 */
+    int32_t hashbits;
+    int32_t hashsign;
+    int32_t optimizer; /* OPT_SGD, OPT_ADAGRAD or OPT_RMSPROP */
+    float eta;
+    uint64_t size; /* of the whole file */
+    uint64_t W1; /* offset of W1[inputs][hidden] */
+    uint64_t b1; /* offset of float b1[hidden] */
+    uint64_t W2; /* offset of float W2[hidden] */
+    uint64_t b2; /* offset of float b2[members] */
+    uint64_t dict; /* offset of int32 dict[inputs], 0 if there is none */
+    uint64_t order; /* offset of int32 order[inputs], 0 if there is none */
+    uint64_t accum; /* offset of float accum[inputs+2], 0 for OPT_SGD */
+}netheader_t;
+
+/* Bytes per weight of the first layer */
+static size_t weightsize(int precision){
+    return precision==PRECISION_BF16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+/* Start of the first layer weights, whatever their type */
+static void* firstlayer(nnet_t* n){
+    return n->precision==PRECISION_BF16 ? (void*)n->H1[0] : (void*)n->W1[0];
+}
+
+static uint64_t netalign(uint64_t x){
+    return (x+NET_ALIGN-1)/NET_ALIGN*NET_ALIGN;
+}
+
+/* Places an array of len bytes after the end of the file so far */
+static uint64_t netplace(uint64_t* end, uint64_t len){
+    uint64_t offset=netalign(*end);
+    *end=offset+len;
+    return offset;
+}
+
+static void netheader(nnet_t* n, netheader_t* h){
+    uint64_t end=sizeof(*h);
+    memset(h,0,sizeof(*h));
+    memcpy(h->magic,NET_MAGIC,8);
+    h->version=NET_VERSION;
+    h->endian=NET_ENDIAN;
+    h->inputs=n->inputs;
+    h->hidden=n->hidden;
+    h->members=n->members;
+    h->precision=n->precision;
+    h->hashbits=n->hashbits;
+    h->hashsign=n->hashsign;
+    h->optimizer=n->optimizer;
+    h->eta=n->eta;
+    h->W1=netplace(&end,weightsize(n->precision)*(uint64_t)n->inputs*n->hidden);
+    h->b1=netplace(&end,sizeof(float)*n->hidden);
+    h->W2=netplace(&end,sizeof(float)*n->hidden);
+    h->b2=netplace(&end,sizeof(float)*n->members);
+    if(n->dict!=NULL)
+        h->dict=netplace(&end,sizeof(int)*n->inputs);
+    if(n->order!=NULL)
+        h->order=netplace(&end,sizeof(int)*n->inputs);
+    if(n->accum!=NULL)
+        h->accum=netplace(&end,sizeof(float)*(n->inputs+2));
+    h->size=end;
+}
+
+/* Copies the part of the file that starts at offset into image */
+static void netput(char* image, uint64_t offset, const void* p, size_t size){
+    memcpy(image+offset,p,size);
+}
+
+/* Serializes the network n into a newly allocated buffer that
+ * holds the complete file, stores it in *image and returns its
+ * length. The rows of W1 must be up to date, see flushnet().
+ */
+size_t packnet(nnet_t* n, char** image){
+    netheader_t h;
+
+    netheader(n,&h);
+    *image=calloc(1,h.size);
+    netput(*image,0,&h,sizeof(h));
+    netput(*image,h.W1,firstlayer(n),weightsize(n->precision)*(size_t)n->inputs*n->hidden);
+    netput(*image,h.b1,n->b1,sizeof(float)*n->hidden);
+    netput(*image,h.W2,n->W2,sizeof(float)*n->hidden);
+    netput(*image,h.b2,n->b2,sizeof(float)*n->members);
+    if(n->dict!=NULL)
+        netput(*image,h.dict,n->dict,sizeof(int)*n->inputs);
+    if(n->order!=NULL)
+        netput(*image,h.order,n->order,sizeof(int)*n->inputs);
+    if(n->accum!=NULL)
+        netput(*image,h.accum,n->accum,sizeof(float)*(n->inputs+2));
+    return h.size;
+}
+
+/* Writes a network serialized by packnet() to a file. The file
+ * is written under a temporary name and then renamed, so readers
+ * never see a partially written network.
+ */
+void writenet(const char* name, const char* image, size_t len){
+    char* tmp;
     FILE *fp;
-    fp=fopen(name,"w");
+    int failed;
+
+    tmp=malloc(strlen(name)+16);
+    sprintf(tmp,"%s.tmp%d",name,(int)getpid());
+    fp=fopen(tmp,"wb");
     if(fp==NULL){
-        fprintf(stderr,"Could not write to file %s\n",name);
+        fprintf(stderr,"Could not write to file %s\n",tmp);
+        free(tmp);
         return;
     }
-    fprintf(fp,"inputs %d\n",n->inputs);
-    fprintf(fp,"hidden %d\n",n->hidden);
-    fprintf(fp,"rate %g\n",n->eta);
-    fwrite(n->W1[0],sizeof(float),n->inputs*n->hidden,fp);
-    fwrite(n->b1,sizeof(float),n->hidden,fp);
-    fwrite(n->W2,sizeof(float),n->hidden,fp);
-    fwrite(&n->b2,sizeof(float),1,fp);
-    fclose(fp);
+    /* A short write must not replace a good network */
+    failed = fwrite(image,1,len,fp)!=len || ferror(fp);
+    if(fclose(fp)!=0 || failed || rename(tmp,name)!=0){
+        fprintf(stderr,"Could not write to file %s\n",name);
+        unlink(tmp);
+    }
+    free(tmp);
 }
 
-/* Loads a network from a file to memory */
-void loadnet(const char* name, nnet_t* n){
-    FILE *fp;
-    int i,c;
-    fp=fopen(name,"r");
-    if(fp==NULL){
-        fprintf(stderr,"Could not load file %s\n",name);
-        return;
+/* Saves the network n to a file */
+void savenet(const char* name, nnet_t* n){
+    char* image;
+    size_t len;
+
+    flushnet(n);
+    len=packnet(n,&image);
+    writenet(name,image,len);
+    free(image);
+}
+
+/* Whether an array of len bytes at offset lies in a file of size bytes */
+static int netwithin(uint64_t offset, uint64_t len, uint64_t size){
+    return offset>=sizeof(netheader_t) && offset<=size && len<=size-offset;
+}
+
+/* Returns 0, after saying why, if h does not describe a valid
+ * network in a file of the given size
+ */
+static int checkheader(const char* name, const netheader_t* h, uint64_t size){
+    uint64_t rows;
+    if(h->endian!=NET_ENDIAN){
+        fprintf(stderr,"File %s was written on a machine with a different byte order\n",name);
+        return 0;
+    }
+    if(h->version!=NET_VERSION){
+        fprintf(stderr,"File %s was written by a different version\n",name);
+        return 0;
+    }
+    if(size<h->size){
+        fprintf(stderr,"File %s is truncated\n",name);
+        return 0;
+    }
+    rows=(uint64_t)(h->inputs>0 ? h->inputs : 0);
+    if(h->inputs<1 || h->hidden<1 || h->members<1 || h->hidden%h->members!=0
+        || (h->precision!=PRECISION_FLOAT && h->precision!=PRECISION_BF16)
+        || h->optimizer<OPT_SGD || h->optimizer>OPT_RMSPROP
+        || !netwithin(h->W1,weightsize(h->precision)*rows*h->hidden,h->size)
+        || !netwithin(h->b1,sizeof(float)*h->hidden,h->size)
+        || !netwithin(h->W2,sizeof(float)*h->hidden,h->size)
+        || !netwithin(h->b2,sizeof(float)*h->members,h->size)
+        || (h->dict!=0 && !netwithin(h->dict,sizeof(int)*rows,h->size))
+        || (h->order!=0 && (h->dict==0 || !netwithin(h->order,sizeof(int)*rows,h->size)))
+        || (h->accum!=0 && !netwithin(h->accum,sizeof(float)*(rows+2),h->size))
+        || (h->optimizer!=OPT_SGD && h->accum==0)){
+        fprintf(stderr,"File %s is not a valid network\n",name);
+        return 0;
     }
+    return 1;
+}
+
+/* Points the rows of W1 at consecutive rows of base */
+static void setrows(nnet_t* n, float* base){
+    size_t i;
+    n->W1 = malloc(sizeof(float*)*n->inputs);
+    for(i=0; i<(size_t)n->inputs; i++)
+        n->W1[i]=base+i*n->hidden;
+    n->H1 = NULL;
+}
+
+/* The same for first layer weights stored as bf16 */
+static void sethalfrows(nnet_t* n, uint16_t* base){
+    size_t i;
+    n->H1 = malloc(sizeof(uint16_t*)*n->inputs);
+    for(i=0; i<(size_t)n->inputs; i++)
+        n->H1[i]=base+i*n->hidden;
+    n->W1 = NULL;
+}
+
+/* Allocates the first layer of n in the storage format of n */
+static void allocrows(nnet_t* n){
+    if(n->precision==PRECISION_BF16)
+        sethalfrows(n,malloc(sizeof(uint16_t)*(size_t)n->inputs*n->hidden));
+    else
+        setrows(n,malloc(sizeof(float)*(size_t)n->inputs*n->hidden));
+}
+
+/* Resets what a network file does not hold */
+static void netdefaults(nnet_t* n){
+    n->map=NULL;
+    n->maplen=0;
+    n->l2=0.0f;
+    n->l1=0.0f;
+    n->step=0;
+    n->last=NULL;
+    n->decay=NULL;
+    n->batch=1;
+    n->dict=NULL;
+    n->order=NULL;
+    n->accum=NULL;
+}
 
-    fscanf(fp,"%*s%d",&n->inputs);
-    fscanf(fp,"%*s%d",&n->hidden);
-    fscanf(fp,"%*s%f",&n->eta);
+/* Loads a network in the text header format of the versions
+ * before the binary format. Returns 0 if the file is not one.
+ */
+static int loadtext(const char* name, FILE* fp, uint64_t size, nnet_t* n){
+    long start;
+    int c;
+
+    rewind(fp);
+    n->hashbits=0;
+    n->hashsign=0;
+    n->precision=PRECISION_FLOAT;
+    n->members=1;
+    n->optimizer=OPT_SGD;
+    if(fscanf(fp,"%*s%d",&n->inputs)!=1 || fscanf(fp,"%*s%d",&n->hidden)!=1
+        || fscanf(fp,"%*s%f",&n->eta)!=1 || n->inputs<1 || n->hidden<1){
+        fprintf(stderr,"File %s is not a valid network\n",name);
+        return 0;
+    }
     do
         c=fgetc(fp);
-    while(c!='\n');
-
-    n->W1 = malloc(sizeof(float*)*n->inputs);
-    n->W1[0] = malloc(sizeof(float)*n->inputs*n->hidden);
-    for(i=1; i<n->inputs; i++)
-        n->W1[i]=n->W1[0]+i*n->hidden;
+    while(c!='\n' && c!=EOF);
+    start=ftell(fp);
+    if(c==EOF || start<0 || size-start<sizeof(float)*((uint64_t)n->inputs*n->hidden+2*n->hidden+1)){
+        fprintf(stderr,"File %s is truncated\n",name);
+        return 0;
+    }
 
+    setrows(n,malloc(sizeof(float)*(size_t)n->inputs*n->hidden));
     n->b1 = malloc(sizeof(float)*n->hidden);
-    n->a1 = malloc(sizeof(float)*n->hidden);
-    n->x1 = malloc(sizeof(float)*n->hidden);
-    n->g1 = malloc(sizeof(float)*n->hidden);
-    n->d1 = malloc(sizeof(float)*n->hidden);
     n->W2 = malloc(sizeof(float)*n->hidden);
+    n->b2 = malloc(sizeof(float));
 
-    fread(n->W1[0],sizeof(float),n->inputs*n->hidden,fp);
+    fread(n->W1[0],sizeof(float),(size_t)n->inputs*n->hidden,fp);
     fread(n->b1,sizeof(float),n->hidden,fp);
     fread(n->W2,sizeof(float),n->hidden,fp);
-    fread(&n->b2,sizeof(float),1,fp);
+    fread(n->b2,sizeof(float),1,fp);
+    return 1;
+}
+
+/* Reads the array at offset of a network file into a new buffer */
+static void* netget(FILE* fp, uint64_t offset, size_t size){
+    void* p=malloc(size);
+    fseek(fp,offset,SEEK_SET);
+    fread(p,1,size,fp);
+    return p;
+}
+
+/* Loads a network from a file to memory. Returns 0, after saying
+ * why, if the file is missing or not a valid network.
+ */
+static int readnet(const char* name, nnet_t* n){
+    netheader_t h;
+    struct stat st;
+    FILE *fp;
+    int ok;
+
+    fp=fopen(name,"rb");
+    if(fp==NULL || fstat(fileno(fp),&st)!=0){
+        fprintf(stderr,"Could not load file %s\n",name);
+        if(fp!=NULL)
+            fclose(fp);
+        return 0;
+    }
+    netdefaults(n);
+    if(fread(&h,sizeof(h),1,fp)!=1 || memcmp(h.magic,NET_MAGIC,8)!=0){
+        ok=loadtext(name,fp,st.st_size,n);
+        fclose(fp);
+        return ok;
+    }
+    if(!checkheader(name,&h,st.st_size)){
+        fclose(fp);
+        return 0;
+    }
+    n->inputs=h.inputs;
+    n->hidden=h.hidden;
+    n->members=h.members;
+    n->precision=h.precision;
+    n->hashbits=h.hashbits;
+    n->hashsign=h.hashsign;
+    n->optimizer=h.optimizer;
+    n->eta=h.eta;
+    allocrows(n);
+    fseek(fp,h.W1,SEEK_SET);
+    fread(firstlayer(n),weightsize(n->precision),(size_t)n->inputs*n->hidden,fp);
+    n->b1=netget(fp,h.b1,sizeof(float)*n->hidden);
+    n->W2=netget(fp,h.W2,sizeof(float)*n->hidden);
+    n->b2=netget(fp,h.b2,sizeof(float)*n->members);
+    if(h.dict!=0)
+        n->dict=netget(fp,h.dict,sizeof(int)*n->inputs);
+    if(h.order!=0)
+        n->order=netget(fp,h.order,sizeof(int)*n->inputs);
+    if(h.accum!=0)
+        n->accum=netget(fp,h.accum,sizeof(float)*(n->inputs+2));
     fclose(fp);
+    return 1;
+}
+
+/* Loads a network from a file to memory */
+void loadnet(const char* name, nnet_t* n){
+    if(!readnet(name,n))
+        exit(1);
+}
+
+/* Maps a network file read-only and uses its weights in place.
+ * Processes that map the same file share a single copy of it in
+ * the page cache. The network must not be trained afterwards.
+ * Files in the old text format are simply loaded.
+ */
+void mapnet(const char* name, nnet_t* n){
+    if(!trymapnet(name,n))
+        exit(1);
+}
+
+/* The same, but returns 0 instead of exiting when the file is
+ * missing or not a valid network, for long running processes
+ * that can go on with the network they have.
+ */
+int trymapnet(const char* name, nnet_t* n){
+    netheader_t h;
+    struct stat st;
+    char* map;
+    int fd;
+
+    fd=open(name,O_RDONLY);
+    if(fd<0 || fstat(fd,&st)!=0){
+        fprintf(stderr,"Could not load file %s\n",name);
+        if(fd>=0)
+            close(fd);
+        return 0;
+    }
+    if((size_t)st.st_size<sizeof(h)){
+        /* too short for the binary header, maybe a text one */
+        close(fd);
+        return readnet(name,n);
+    }
+    map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(map==MAP_FAILED){
+        fprintf(stderr,"Could not map file %s\n",name);
+        return 0;
+    }
+    memcpy(&h,map,sizeof(h));
+    if(memcmp(h.magic,NET_MAGIC,8)!=0){
+        munmap(map,st.st_size);
+        return readnet(name,n);
+    }
+    if(!checkheader(name,&h,st.st_size)){
+        munmap(map,st.st_size);
+        return 0;
+    }
+    netdefaults(n);
+    n->inputs=h.inputs;
+    n->hidden=h.hidden;
+    n->members=h.members;
+    n->precision=h.precision;
+    n->hashbits=h.hashbits;
+    n->hashsign=h.hashsign;
+    n->optimizer=h.optimizer;
+    n->eta=h.eta;
+    if(n->precision==PRECISION_BF16)
+        sethalfrows(n,(uint16_t*)(map+h.W1));
+    else
+        setrows(n,(float*)(map+h.W1));
+    n->b1=(float*)(map+h.b1);
+    n->W2=(float*)(map+h.W2);
+    n->b2=(float*)(map+h.b2);
+    n->dict = h.dict==0 ? NULL : (int*)(map+h.dict);
+    n->order = h.order==0 ? NULL : (int*)(map+h.order);
+    n->accum = h.accum==0 ? NULL : (float*)(map+h.accum);
+    n->map=map;
+    n->maplen=st.st_size;
+    return 1;
+}
+
+/* Brings input vectors into the feature space of network n:
+ * features are hashed if the network was trained on hashed
+ * features, looked up in its dictionary if it has one, and
+ * otherwise the ones it has never seen are dropped.
+ * The vectors must be writable.
+ */
+void prepvectors(nnet_t* n, sparse_t* v, int len){
+    if(n->hashbits>0)
+        hashvectors(n->hashbits, n->hashsign, v, len);
+    else if(n->dict!=NULL)
+        remapvectors(n->dict, n->order, n->inputs, v, len);
+    else
+        clipvectors(n->inputs, v, len);
 }
 
 /* Releases the memory held by a network */
 void destroynet(nnet_t* n){
-    free(n->W1[0]);
+    if(n->map!=NULL){
+        munmap(n->map,n->maplen);
+        free(n->W1);
+        free(n->H1);
+        return;
+    }
+    free(firstlayer(n));
     free(n->W1);
+    free(n->H1);
     free(n->b1);
-    free(n->a1);
-    free(n->x1);
-    free(n->g1);
-    free(n->d1);
     free(n->W2);
+    free(n->b2);
+    free(n->dict);
+    free(n->order);
+    free(n->last);
+    free(n->decay);
+    free(n->accum);
+}
+
+/* Copies the weights of src into dst, for example to evaluate
+ * or save them while src keeps training. dst must be zeroed the
+ * first time; later copies from the same network reuse its memory.
+ * The rows of src must be up to date, see flushnet().
+ */
+void copynet(nnet_t* dst, nnet_t* src){
+    if(dst->W1==NULL && dst->H1==NULL){
+        memset(dst,0,sizeof(*dst));
+        dst->inputs=src->inputs;
+        dst->hidden=src->hidden;
+        dst->precision=src->precision;
+        dst->members=src->members;
+        allocrows(dst);
+        dst->b1=malloc(sizeof(float)*src->hidden);
+        dst->W2=malloc(sizeof(float)*src->hidden);
+        dst->b2=malloc(sizeof(float)*src->members);
+        if(src->dict!=NULL){
+            dst->dict=malloc(sizeof(int)*src->inputs);
+            memcpy(dst->dict,src->dict,sizeof(int)*src->inputs);
+        }
+        if(src->order!=NULL){
+            dst->order=malloc(sizeof(int)*src->inputs);
+            memcpy(dst->order,src->order,sizeof(int)*src->inputs);
+        }
+        if(src->accum!=NULL)
+            dst->accum=malloc(sizeof(float)*(src->inputs+2));
+    }
+    memcpy(firstlayer(dst),firstlayer(src),weightsize(src->precision)*(size_t)src->inputs*src->hidden);
+    memcpy(dst->b1,src->b1,sizeof(float)*src->hidden);
+    memcpy(dst->W2,src->W2,sizeof(float)*src->hidden);
+    memcpy(dst->b2,src->b2,sizeof(float)*src->members);
+    if(src->accum!=NULL)
+        memcpy(dst->accum,src->accum,sizeof(float)*(src->inputs+2));
+    dst->optimizer=src->optimizer;
+    dst->eta=src->eta;
+    dst->hashbits=src->hashbits;
+    dst->hashsign=src->hashsign;
+    dst->batch=src->batch;
+}
+
+/* Converts the first layer of n to the given storage format.
+ * bf16 halves the memory and bandwidth of W1; the weights keep
+ * the range of floats but only about 3 significant digits.
+ */
+void quantizenet(nnet_t* n, int precision){
+    void* old;
+    size_t len=(size_t)n->inputs*n->hidden;
+    float** W1=n->W1;
+    uint16_t** H1=n->H1;
+
+    if(precision==n->precision)
+        return;
+    old=firstlayer(n);
+    n->precision=precision;
+    allocrows(n);
+    if(precision==PRECISION_BF16)
+        tobf16(n->H1[0],old,len);
+    else
+        frombf16(n->W1[0],old,len);
+    free(old);
+    free(W1);
+    free(H1);
+}
+
+/* Working memory for a mini-batch. The first group holds one
+ * row of hidden values per example, the second one value per
+ * example. The rest merges the gradients of rows of W1 that
+ * several examples of the batch use.
+ */
+struct batch_t{
+    int size;      /* examples the buffers can hold */
+    float* A1;
+    float* X1;
+    float* G1;
+    float* D1;
+    float* a2;
+    float* x2;
+    float* g2;
+    float* d2;
+    long tablesize; /* a power of two, at least twice the nonzeros */
+    int* row;      /* row of W1 kept in each table entry, -1 if none */
+    int* slot;     /* gradient slot of each table entry */
+    float* grad;   /* accumulated gradients, one row per slot */
+    float** gradrow; /* start of each slot in grad, for the scatter kernel */
+    int* gradrows; /* row of W1 of each slot */
+    int* slotidx;  /* slot of every nonzero of the batch */
+};
+
+/* Allocates the per-thread working memory for network n */
+void createscratch(nnet_t* n, scratch_t* s){
+    s->a1 = malloc(sizeof(float)*n->hidden);
+    s->x1 = malloc(sizeof(float)*n->hidden);
+    s->g1 = malloc(sizeof(float)*n->hidden);
+    s->d1 = malloc(sizeof(float)*n->hidden);
+    s->a2 = malloc(sizeof(float)*n->members);
+    s->x2 = malloc(sizeof(float)*n->members);
+    s->g2 = malloc(sizeof(float)*n->members);
+    s->d2 = malloc(sizeof(float)*n->members);
+    s->shared = 0;
+    s->batch = NULL;
+    s->rates = NULL;
+    s->nrates = 0;
+    s->seed = 2463534242u ^ (uint32_t)(uintptr_t)s;
+    if(s->seed==0)
+        s->seed=1;
+}
+
+/* Releases the memory held by a scratch */
+void destroyscratch(scratch_t* s){
+    free(s->a1);
+    free(s->x1);
+    free(s->g1);
+    free(s->d1);
+    free(s->a2);
+    free(s->x2);
+    free(s->g2);
+    free(s->d2);
+    free(s->rates);
+    if(s->batch!=NULL){
+        free(s->batch->A1);
+        free(s->batch->X1);
+        free(s->batch->G1);
+        free(s->batch->D1);
+        free(s->batch->a2);
+        free(s->batch->x2);
+        free(s->batch->g2);
+        free(s->batch->d2);
+        free(s->batch->row);
+        free(s->batch->slot);
+        free(s->batch->grad);
+        free(s->batch->gradrow);
+        free(s->batch->gradrows);
+        free(s->batch->slotidx);
+        free(s->batch);
+    }
 }
 
 /* Activation function and derivative(s).
@@ -139,11 +683,13 @@ void destroynet(nnet_t* n){
  * an eight degree Chebychev polynomial and a constant function (when the 
  * input is larger than 10. Finally the value of the derivative is biased
  * by 0.01 to avoid flat spots.
+ * Whole hidden layers go through the vectorized version in
+ * kernels.c; whatever it leaves over is done here.
  */
 void activation(float* x, float *f, float * g, /* float * h,*/ int n){
     float d,dd,y,y2,z,t,u,s;
     int i;
-    for(i=0; i<n; i++){
+    for(i=activationsimd(x,f,g,n); i<n; i++){
         if(x[i]<0){
             z=-x[i];
             s=-1.0f;
@@ -180,71 +726,620 @@ void activation(float* x, float *f, float * g, /* float * h,*/ int n){
     }
 }
 
+/* Turns on regularization of the weights of network n: every
+ * training step multiplies them by 1-eta*l2 and then moves them
+ * eta*l1 closer to zero, stopping at zero. Only W1 and W2 are
+ * regularized. The decay uses n->eta whatever the optimizer, so
+ * l2 and l1 are per step of eta; under the adaptive optimizers
+ * they do not follow the rates of the rows.
+ */
+void regularize(nnet_t* n, float l2, float l1){
+    double c=1.0-(double)n->eta*l2;
+    int i;
+    n->l2=l2;
+    n->l1=l1;
+    n->step=0;
+    n->last=calloc(n->inputs+1,sizeof(long));
+    /* Table of c^k and c^(1024k) for k<1024, so that decaying a
+     * row by any number of steps below 2^20 takes one product.
+     * catchup() works out longer gaps from logarithms.
+     */
+    n->decay=malloc(2048*sizeof(float));
+    for(i=0; i<1024; i++){
+        n->decay[i]=pow(c,i);
+        n->decay[1024+i]=pow(c,1024.0*i);
+    }
+}
+
+/* Applying the decay to all of W1 at every step would cost
+ * O(inputs*hidden) per example. Instead each row remembers the
+ * step up to which it has been decayed, and is brought up to
+ * date only when an example uses it. k steps of decay compose
+ * into one multiplication by c^k, c=1-eta*l2, followed by a
+ * shrinkage of eta*l1*(1+c+...+c^(k-1)), which is exact because
+ * a weight that reaches zero stays there. When several threads
+ * train the network a compare and swap makes sure that only one
+ * of them decays a row for given steps.
+ */
+static void decayrow(float* w, int len, float scale, float shrink){
+    int i;
+    if(shrink>0){
+        for(i=0; i<len; i++)
+            w[i]=copysignf(fmaxf(fabsf(w[i]*scale)-shrink,0.0f),w[i]);
+    }
+    else{
+        for(i=0; i<len; i++)
+            w[i]*=scale;
+    }
+}
+
+/* bf16 rows are decayed in float a piece at a time. Rows that
+ * are used at every step are decayed one step at a time, and w*c
+ * rounded to nearest would give back w, so the result is rounded
+ * stochastically like the updates of the scatter.
+ */
+static void decayhalfrow(uint16_t* w, int len, float scale, float shrink, uint32_t* seed){
+    float tmp[64];
+    int i,m;
+    for(i=0; i<len; i+=64){
+        m = len-i < 64 ? len-i : 64;
+        frombf16(tmp,w+i,m);
+        decayrow(tmp,m,scale,shrink);
+        tobf16random(w+i,tmp,m,seed);
+    }
+}
+
+/* Brings row i of W1, or W2 if i is n->inputs, up to step t.
+ * seed is the state of the stochastic rounding of bf16 rows.
+ */
+static void catchup(nnet_t* n, int i, long t, int shared, uint32_t* seed){
+    long* last=&n->last[i];
+    long old=*last;
+    long k;
+    double e;
+    float scale,shrink;
+
+    if(old>=t)
+        return;
+    if(!shared)
+        *last=t;
+    else if(!__sync_bool_compare_and_swap(last,old,t))
+        return;
+    if(n->l2>0){
+        k=t-old;
+        if(k < 1024*1024){
+            scale=n->decay[k&1023]*n->decay[1024+(k>>10)];
+            shrink=n->l1*(1.0f-scale)/n->l2;
+        }
+        else{
+            /* Rows of rare features in large training sets */
+            e=k*log1p(-(double)n->eta*n->l2);
+            scale=exp(e);
+            shrink=n->l1*-expm1(e)/n->l2;
+        }
+    }
+    else{
+        scale=1.0f;
+        shrink=n->eta*n->l1*(t-old);
+    }
+    if(i==n->inputs)
+        decayrow(n->W2,n->hidden,scale,shrink);
+    else if(n->precision==PRECISION_BF16)
+        decayhalfrow(n->H1[i],n->hidden,scale,shrink,seed);
+    else
+        decayrow(n->W1[i],n->hidden,scale,shrink);
+}
+
+/* Brings all the rows of a regularized network up to date, which
+ * must be done before the weights are read by anything but train.
+ */
+void flushnet(nnet_t* n){
+    uint32_t seed=(2463534242u^(uint32_t)n->step)|1u;
+    int i;
+    if(n->last==NULL)
+        return;
+    for(i=0; i<n->inputs; i++)
+        catchup(n, i, n->step, 0, &seed);
+    catchup(n, n->inputs, n->step, 0, &seed);
+}
+
+/* Moving averages of OPT_RMSPROP keep this much of their old value */
+#define ADAPT_DECAY 0.9f
+/* Keeps the rate finite for gradients that are all zero */
+#define ADAPT_EPSILON 1e-6f
+
+/* Gives every row of W1 its own learning rate eta/sqrt(G), where
+ * G is the sum (OPT_ADAGRAD) or a moving average (OPT_RMSPROP) of
+ * the mean squared gradients of the row. Rows of rare features
+ * keep large rates while those of frequent ones settle down. G of
+ * a row only changes when an example uses the row, so a step still
+ * costs time proportional to the nonzeros; with OPT_RMSPROP the
+ * average of an unused row therefore does not decay. b1 and the
+ * output layer (W2 and b2) have one G each, after the rows.
+ * OPT_SGD drops the accumulators. Switching between the adaptive
+ * optimizers keeps them, so that a loaded network resumes where
+ * it stopped.
+ */
+void adaptnet(nnet_t* n, int optimizer){
+    n->optimizer=optimizer;
+    if(optimizer==OPT_SGD){
+        free(n->accum);
+        n->accum=NULL;
+    }
+    else if(n->accum==NULL)
+        n->accum=calloc(n->inputs+2,sizeof(float));
+}
+
+/* Adds a gradient whose squares average g2 to accumulator i and
+ * returns the learning rate of its parameters. When several
+ * threads train the network they may lose each other's additions,
+ * which only perturbs the rate a little.
+ */
+static float adaptrate(nnet_t* n, int i, float g2){
+    float* a=&n->accum[i];
+    if(n->optimizer==OPT_ADAGRAD)
+        *a+=g2;
+    else
+        *a=ADAPT_DECAY*(*a)+(1.0f-ADAPT_DECAY)*g2;
+    return n->eta/(sqrtf(*a)+ADAPT_EPSILON);
+}
+
+/* Points u at the nonzeros of v, each multiplied by the rate of
+ * its row for the gradient x*d, so that a scatter of d with rate
+ * 1 updates every row with its own rate.
+ */
+static void adaptrows(nnet_t* n, scratch_t* s, sparse_t* v, const float* d, sparse_t* u){
+    float g2=cblas_sdot(n->hidden,d,1,d,1)/n->hidden;
+    int i;
+    if(s->nrates<v->nz){
+        s->nrates=v->nz;
+        s->rates=realloc(s->rates,sizeof(float)*v->nz);
+    }
+    for(i=0; i<v->nz; i++)
+        s->rates[i]=v->x[i]*adaptrate(n, v->idx[i], v->x[i]*v->x[i]*g2);
+    u->x=s->rates;
+    u->idx=v->idx;
+    u->nz=v->nz;
+}
+
+/* a = b1 + the rows of W1 of the nonzeros of v, in either format */
+static void gather(nnet_t* n, float* a, sparse_t* v){
+    if(n->precision==PRECISION_BF16)
+        sparsegatherbf16(a, n->b1, n->H1, v, n->hidden);
+    else
+        sparsegather(a, n->b1, n->W1, v, n->hidden);
+}
+
+static void scatter(nnet_t* n, scratch_t* s, sparse_t* v, float eta, const float* d){
+    if(n->precision==PRECISION_BF16)
+        sparsescatterbf16(n->H1, v, eta, d, n->hidden, &s->seed);
+    else
+        sparsescatter(n->W1, v, eta, d, n->hidden);
+}
+
+/* The output unit of every member from the hidden units in
+ * s->x1. The output of the network is their average.
+ */
+static void outputs(nnet_t* n, scratch_t* s){
+    int k,h=n->hidden/n->members;
+    float sum=0.0f;
+    for(k=0; k<n->members; k++)
+        s->a2[k] = n->b2[k] + cblas_sdot(h, n->W2+k*h, 1, s->x1+k*h, 1);
+    activation(s->a2,s->x2,s->g2,n->members);
+    for(k=0; k<n->members; k++)
+        sum+=s->x2[k];
+    s->out = n->members==1 ? s->x2[0] : sum/n->members;
+}
+
 /* Trains a network by presenting an example and 
  * adjusts the weights by stochastic gradient 
  * descent to reduce a squared hinge loss
  */
-void train(nnet_t* n, sparse_t* v, int target){
-    int i;
+void train(nnet_t* n, scratch_t* s, sparse_t* v, int target){
+    sparse_t u;
+    long t;
+    float rate,g2;
+    int i,k,h,active;
+    TELEMETRY_TIMER(tick);
+    TELEMETRY_COUNT(TC_EXAMPLES, 1);
+    TELEMETRY_COUNT(TC_NNZ, v->nz);
+    if(n->last!=NULL){
+        /* Decay the weights this example is about to use */
+        t = s->shared ? __sync_fetch_and_add(&n->step,1) : n->step++;
+        for(i=0; i<v->nz; i++)
+            catchup(n, v->idx[i], t, s->shared, &s->seed);
+        catchup(n, n->inputs, t, s->shared, &s->seed);
+    }
     /* Forward pass */
-    cblas_scopy(n->hidden,n->b1,1,n->a1,1);
-    for(i=0; i<v->nz; i++){
-        cblas_saxpy(n->hidden, v->x[i], n->W1[v->idx[i]], 1, n->a1, 1);
+    gather(n, s->a1, v);
+    activation(s->a1,s->x1,s->g1,n->hidden);
+    outputs(n, s);
+    TELEMETRY_LAP(TM_FORWARD, tick);
+    /* Hinge loss, no error -> no need to backpropagate.
+     * Every member of an ensemble decides for itself.
+     */
+    active=0;
+    for(k=0; k<n->members; k++){
+        if(target*s->x2[k] > 1)
+            s->d2[k]=0.0f;
+        else{
+            s->d2[k]=(target-s->x2[k])*s->g2[k];
+            active+=1;
+        }
     }
-    activation(n->a1,n->x1,n->g1,n->hidden);
-    n->a2 = n->b2 + cblas_sdot(n->hidden, n->W2, 1, n->x1, 1);
-    activation(&n->a2,&n->x2,&n->g2,1);
-    if(target*n->x2 > 1)
-        /* Hinge loss, no error -> no need to backpropagate */
+    if(active==0){
+        TELEMETRY_COUNT(TC_SKIPPED, 1);
         return;
+    }
     /* Backward pass */
-    n->d2 = (target-n->x2)*n->g2;
-    cblas_scopy(n->hidden,n->W2,1,n->d1,1);
-    for(i=0; i<n->hidden; i++)
-        n->d1[i] *= n->d2*n->g1[i];
-    n->b2 += n->eta*n->d2;
-    cblas_saxpy(n->hidden, n->eta*n->d2, n->x1, 1, n->W2, 1);
-    cblas_saxpy(n->hidden, n->eta, n->d1, 1, n->b1, 1);
+    h=n->hidden/n->members;
+    rate=n->eta;
+    if(n->accum!=NULL){
+        g2=0.0f;
+        for(k=0; k<n->members; k++){
+            if(s->d2[k]!=0.0f)
+                g2+=s->d2[k]*s->d2[k]*(cblas_sdot(h, s->x1+k*h, 1, s->x1+k*h, 1)+1.0f);
+        }
+        rate=adaptrate(n, n->inputs+1, g2/(n->hidden+n->members));
+    }
+    for(k=0; k<n->members; k++){
+        if(s->d2[k]==0.0f){
+            memset(s->d1+k*h,0,sizeof(float)*h);
+            continue;
+        }
+        for(i=k*h; i<(k+1)*h; i++)
+            s->d1[i] = n->W2[i]*s->d2[k]*s->g1[i];
+        n->b2[k] += rate*s->d2[k];
+        cblas_saxpy(h, rate*s->d2[k], s->x1+k*h, 1, n->W2+k*h, 1);
+    }
+    if(n->accum!=NULL)
+        rate=adaptrate(n, n->inputs, cblas_sdot(n->hidden, s->d1, 1, s->d1, 1)/n->hidden);
+    cblas_saxpy(n->hidden, rate, s->d1, 1, n->b1, 1);
     /* Sparse inputs imply sparse gradients.
      * This update saves a lot of computation
      * compared to general purpose neural net
-     * implementations.
+     * implementations. The rows of an ensemble hold
+     * all of its members, so one pass over the
+     * nonzeros updates them all.
      */
-    for(i=0; i<v->nz; i++){
-        cblas_saxpy(n->hidden, n->eta*v->x[i], n->d1, 1, n->W1[v->idx[i]], 1);
+    if(n->accum==NULL)
+        scatter(n, s, v, n->eta, s->d1);
+    else{
+        adaptrows(n, s, v, s->d1, &u);
+        scatter(n, s, &u, 1.0f, s->d1);
     }
+    TELEMETRY_LAP(TM_BACKWARD, tick);
 }
 
 /* Given an input vector v, compute the output of the network. */
-float value(nnet_t* n, sparse_t* v){
+float value(nnet_t* n, scratch_t* s, sparse_t* v){
+    gather(n, s->a1, v);
+    activation(s->a1,s->x1,s->g1,n->hidden);
+    outputs(n, s);
+    return s->out;
+}
+
+/* Makes sure the batch buffers of s fit count examples with nnz
+ * nonzeros in total.
+ */
+static struct batch_t* batchbuffers(nnet_t* n, scratch_t* s, int count, long nnz){
+    struct batch_t* b=s->batch;
+    long h=n->hidden;
+    if(b==NULL){
+        b=s->batch=calloc(1,sizeof(struct batch_t));
+    }
+    if(b->size<count){
+        b->size=count;
+        b->A1=realloc(b->A1,sizeof(float)*count*h);
+        b->X1=realloc(b->X1,sizeof(float)*count*h);
+        b->G1=realloc(b->G1,sizeof(float)*count*h);
+        b->D1=realloc(b->D1,sizeof(float)*count*h);
+        b->a2=realloc(b->a2,sizeof(float)*count);
+        b->x2=realloc(b->x2,sizeof(float)*count);
+        b->g2=realloc(b->g2,sizeof(float)*count);
+        b->d2=realloc(b->d2,sizeof(float)*count);
+    }
+    if(b->tablesize<2*nnz){
+        while(b->tablesize<2*nnz)
+            b->tablesize = b->tablesize ? 2*b->tablesize : 1024;
+        b->row=realloc(b->row,sizeof(int)*b->tablesize);
+        b->slot=realloc(b->slot,sizeof(int)*b->tablesize);
+        /* there are never more slots than nonzeros */
+        b->grad=realloc(b->grad,sizeof(float)*h*(b->tablesize/2));
+        b->gradrow=realloc(b->gradrow,sizeof(float*)*(b->tablesize/2));
+        b->gradrows=realloc(b->gradrows,sizeof(int)*(b->tablesize/2));
+        b->slotidx=realloc(b->slotidx,sizeof(int)*(b->tablesize/2));
+    }
+    return b;
+}
+
+/* Trains the network on count examples of d at once, the ones
+ * whose indices are in ex. The hidden layer inputs of the whole
+ * batch come from the sparse gather kernel, the output layer is
+ * one matrix-vector product, and the gradients of the rows of
+ * W1 are summed per row before they are applied, so a row that
+ * appears in several examples is only written once. n must
+ * have a single member; nnlearn rejects -K together with -B.
+ */
+void trainbatch(nnet_t* n, scratch_t* s, dataset_t* d, int* ex, int count){
+    struct batch_t* b;
+    sparse_t* v;
+    sparse_t u;
+    long nnz,t,k,e;
+    float sum,rate;
+    int i,j,h,r,slots,active;
+    TELEMETRY_TIMER(tick);
+
+    h=n->hidden;
+    nnz=0;
+    for(i=0; i<count; i++)
+        nnz+=d->example[ex[i]].nz;
+    TELEMETRY_COUNT(TC_EXAMPLES, count);
+    TELEMETRY_COUNT(TC_NNZ, nnz);
+    b=batchbuffers(n,s,count,nnz);
+    if(n->last!=NULL){
+        /* Decay the rows of the batch up to its first step */
+        t = s->shared ? __sync_fetch_and_add(&n->step,count) : (n->step+=count)-count;
+        for(i=0; i<count; i++){
+            v=&d->example[ex[i]];
+            for(j=0; j<v->nz; j++)
+                catchup(n, v->idx[j], t, s->shared, &s->seed);
+        }
+        catchup(n, n->inputs, t, s->shared, &s->seed);
+    }
+    /* Forward pass */
+    for(i=0; i<count; i++)
+        gather(n, b->A1+(long)i*h, &d->example[ex[i]]);
+    activation(b->A1,b->X1,b->G1,count*h);
+    for(i=0; i<count; i++)
+        b->a2[i]=n->b2[0];
+    cblas_sgemv(CblasRowMajor, CblasNoTrans, count, h, 1.0f, b->X1, h, n->W2, 1, 1.0f, b->a2, 1);
+    activation(b->a2,b->x2,b->g2,count);
+    active=0;
+    for(i=0; i<count; i++){
+        /* Hinge loss, no error -> no need to backpropagate */
+        if(d->target[ex[i]]*b->x2[i] > 1)
+            b->d2[i]=0.0f;
+        else{
+            b->d2[i]=(d->target[ex[i]]-b->x2[i])*b->g2[i];
+            active+=1;
+        }
+    }
+    TELEMETRY_LAP(TM_FORWARD, tick);
+    TELEMETRY_COUNT(TC_SKIPPED, count-active);
+    if(active==0)
+        return;
+    /* Backward pass, all gradients are taken at the old weights */
+    sum=0.0f;
+    for(i=0; i<count; i++){
+        sum+=b->d2[i];
+        for(j=0; j<h; j++)
+            b->D1[(long)i*h+j]=b->d2[i]*n->W2[j]*b->G1[(long)i*h+j];
+    }
+    /* The gradients of W2 and b1, in scratch the batch does not use */
+    cblas_sgemv(CblasRowMajor, CblasTrans, count, h, 1.0f, b->X1, h, b->d2, 1, 0.0f, s->a1, 1);
+    memset(s->d1,0,sizeof(float)*h);
+    for(i=0; i<count; i++){
+        if(b->d2[i]!=0.0f)
+            cblas_saxpy(h, 1.0f, b->D1+(long)i*h, 1, s->d1, 1);
+    }
+    rate=n->eta;
+    if(n->accum!=NULL)
+        rate=adaptrate(n, n->inputs+1, (cblas_sdot(h, s->a1, 1, s->a1, 1)+sum*sum)/(h+1));
+    n->b2[0] += rate*sum;
+    cblas_saxpy(h, rate, s->a1, 1, n->W2, 1);
+    if(n->accum!=NULL)
+        rate=adaptrate(n, n->inputs, cblas_sdot(h, s->d1, 1, s->d1, 1)/h);
+    cblas_saxpy(h, rate, s->d1, 1, n->b1, 1);
+    /* Give every distinct row of W1 in the batch a gradient slot */
+    for(k=0; k<b->tablesize; k++)
+        b->row[k]=-1;
+    slots=0;
+    e=0;
+    for(i=0; i<count; i++){
+        if(b->d2[i]==0.0f)
+            continue;
+        v=&d->example[ex[i]];
+        for(j=0; j<v->nz; j++){
+            r=v->idx[j];
+            k=((uint32_t)r*2654435761u)&(b->tablesize-1);
+            while(b->row[k]!=-1 && b->row[k]!=r)
+                k=(k+1)&(b->tablesize-1);
+            if(b->row[k]==-1){
+                b->row[k]=r;
+                b->slot[k]=slots;
+                b->gradrows[slots]=r;
+                b->gradrow[slots]=b->grad+(long)slots*h;
+                memset(b->gradrow[slots],0,sizeof(float)*h);
+                slots+=1;
+            }
+            b->slotidx[e+j]=b->slot[k];
+        }
+        /* Accumulate x*D1 of this example into the slots */
+        u.x=v->x;
+        u.idx=b->slotidx+e;
+        u.nz=v->nz;
+        sparsescatter(b->gradrow, &u, 1.0f, b->D1+(long)i*h, h);
+        e+=v->nz;
+    }
+    for(i=0; i<slots; i++){
+        rate=n->eta;
+        if(n->accum!=NULL)
+            rate=adaptrate(n, b->gradrows[i], cblas_sdot(h, b->gradrow[i], 1, b->gradrow[i], 1)/h);
+        if(n->precision==PRECISION_BF16)
+            axpybf16(n->H1[b->gradrows[i]], rate, b->gradrow[i], h, &s->seed);
+        else
+            cblas_saxpy(h, rate, b->gradrow[i], 1, n->W1[b->gradrows[i]], 1);
+    }
+    TELEMETRY_LAP(TM_BACKWARD, tick);
+}
+
+/* How many examples ahead of the one being trained on or scored
+ * the rows of W1 are prefetched. Far enough to hide the latency
+ * of the misses, near enough that the rows are still in cache.
+ */
+#define PREFETCH_AHEAD 8
+
+/* Starts loading the rows of W1 that v will use into the cache.
+ * The rows are found from the start of the first layer rather
+ * than through W1[], which would be one more miss per row.
+ */
+static void prefetchrows(nnet_t* n, const sparse_t* v){
+    const char* base=firstlayer(n);
+    size_t row=weightsize(n->precision)*n->hidden;
+    const char* p;
+    size_t off;
     int i;
-    cblas_scopy(n->hidden,n->b1,1,n->a1,1);
     for(i=0; i<v->nz; i++){
-        cblas_saxpy(n->hidden, v->x[i], n->W1[v->idx[i]], 1, n->a1, 1);
+        p=base+(size_t)v->idx[i]*row;
+        for(off=0; off<row; off+=64)
+            __builtin_prefetch(p+off);
     }
-    activation(n->a1,n->x1,n->g1,n->hidden);
-    n->a2 = n->b2;
-    n->a2 += cblas_sdot(n->hidden, n->W2, 1, n->x1, 1);
-    activation(&n->a2,&n->x2,&n->g2,1);
-    return n->x2;
+}
+
+/* A slice of an epoch handed to one training thread */
+typedef struct trainslice_t{
+    nnet_t* n;
+    dataset_t* d;
+    int* perm;
+    float* p; /* where to record the predictions, or NULL */
+    int begin;
+    int end;
+    int shared; /* whether other slices train at the same time */
+}trainslice_t;
+
+static void* trainslice(void* arg){
+    trainslice_t* t = arg;
+    scratch_t s;
+    int i,j,count;
+    createscratch(t->n, &s);
+    s.shared = t->shared;
+    if(t->n->batch>1){
+        for(i=t->begin; i<t->end; i+=t->n->batch){
+            count = i+t->n->batch<t->end ? t->n->batch : t->end-i;
+            /* the next batch */
+            for(j=i+count; j<i+2*count && j<t->end; j++)
+                prefetchrows(t->n, &t->d->example[t->perm[j]]);
+            trainbatch(t->n, &s, t->d, t->perm+i, count);
+            if(t->p!=NULL){
+                for(j=0; j<count; j++)
+                    t->p[t->perm[i+j]]=s.batch->x2[j];
+            }
+        }
+    }
+    else{
+        for(i=t->begin; i<t->end; i++){
+            if(i+PREFETCH_AHEAD<t->end)
+                prefetchrows(t->n, &t->d->example[t->perm[i+PREFETCH_AHEAD]]);
+            train(t->n, &s, &(t->d->example[t->perm[i]]), t->d->target[t->perm[i]]);
+            if(t->p!=NULL)
+                t->p[t->perm[i]]=s.out;
+        }
+    }
+    destroyscratch(&s);
+    TELEMETRY_FLUSH();
+    return NULL;
 }
 
 /* Run one epoch of training with a given dataset.
  * Perm stores a permutation of the examples. 
  * Shuffling the examples before each epoch helps 
  * the convergence to stochastic gradient descent.
+ * With more than one thread each thread trains on its own
+ * contiguous slice of perm and updates the shared weights
+ * without any locking (Hogwild). Sparse examples touch few
+ * rows of W1, so threads rarely overwrite each other.
+ * If p is not NULL, p[i] receives the prediction for example i
+ * just before the network was trained on it. These predictions
+ * were made without having seen the example (progressive
+ * validation) and cost no extra forward pass.
+ */
+void trainnet(nnet_t* n, dataset_t* d, int* perm, float* p, int threads){
+    trainpart(n, d, perm, d->nex, p, threads);
+}
+
+/* Like trainnet() but only trains on the first count examples
+ * of perm, for callers that split an epoch into parts.
  */
-void trainnet(nnet_t* n, dataset_t* d, int* perm){
+void trainpart(nnet_t* n, dataset_t* d, int* perm, int count, float* p, int threads){
+    trainslice_t* t;
+    pthread_t* tid;
     int i;
-    for(i=0; i<d->nex; i++)
-        train(n, &(d->example[perm[i]]), d->target[perm[i]]);
+
+    if(threads>count)
+        threads=count;
+    if(threads<=1){
+        trainslice_t all = {n, d, perm, p, 0, count, 0};
+        trainslice(&all);
+        return;
+    }
+    t = malloc(sizeof(trainslice_t)*threads);
+    tid = malloc(sizeof(pthread_t)*threads);
+    for(i=0; i<threads; i++){
+        t[i].n = n;
+        t[i].d = d;
+        t[i].perm = perm;
+        t[i].p = p;
+        t[i].begin = (int)((long)count*i/threads);
+        t[i].end = (int)((long)count*(i+1)/threads);
+        t[i].shared = 1;
+        pthread_create(&tid[i], NULL, trainslice, &t[i]);
+    }
+    for(i=0; i<threads; i++)
+        pthread_join(tid[i], NULL);
+    free(tid);
+    free(t);
+}
+
+/* Examples are handed out to the scoring threads in chunks
+ * of this size, so threads that get cheap examples simply
+ * come back for more.
+ */
+#define TESTCHUNK 1024
+
+typedef struct testjob_t{
+    nnet_t* n;
+    dataset_t* d;
+    float* p;
+    int next; /* first example not yet handed out */
+}testjob_t;
+
+static void* testchunks(void* arg){
+    testjob_t* t = arg;
+    scratch_t s;
+    int i,begin,end;
+    createscratch(t->n, &s);
+    while((begin=__sync_fetch_and_add(&t->next, TESTCHUNK)) < t->d->nex){
+        end = begin+TESTCHUNK < t->d->nex ? begin+TESTCHUNK : t->d->nex;
+        for(i=begin; i<end; i++){
+            if(i+PREFETCH_AHEAD<end)
+                prefetchrows(t->n, &t->d->example[i+PREFETCH_AHEAD]);
+            t->p[i]=value(t->n, &s, &(t->d->example[i]));
+        }
+    }
+    destroyscratch(&s);
+    return NULL;
 }
 
 /* Get the predictions of the net for the examples
- * in dataset d and store them in p.
+ * in dataset d and store them in p, using the given
+ * number of threads. The network is only read.
  */
-void testnet(nnet_t* n, dataset_t* d, float *p){
+void testnet(nnet_t* n, dataset_t* d, float *p, int threads){
+    testjob_t t = {n, d, p, 0};
+    pthread_t* tid;
     int i;
-    for(i=0; i<d->nex; i++)
-        p[i]=value(n, &(d->example[i]));
+
+    if(threads>1+d->nex/TESTCHUNK)
+        threads=1+d->nex/TESTCHUNK;
+    if(threads<=1){
+        testchunks(&t);
+        return;
+    }
+    tid = malloc(sizeof(pthread_t)*threads);
+    for(i=0; i<threads; i++)
+        pthread_create(&tid[i], NULL, testchunks, &t);
+    for(i=0; i<threads; i++)
+        pthread_join(tid[i], NULL);
+    free(tid);
 }
@@ -9,42 +9,109 @@
 #ifndef NNET_H
 #define NNET_H
 
+#include <stdint.h>
 #include "dataset.h"
 
+/* Storage formats of the first layer weights */
+#define PRECISION_FLOAT 0
+#define PRECISION_BF16 1
+
+/* Optimizers, see adaptnet() */
+#define OPT_SGD 0
+#define OPT_ADAGRAD 1
+#define OPT_RMSPROP 2
+
+/* A network can be an ensemble of members networks with
+ * hidden/members hidden units each, trained together on the same
+ * examples. Row i of W1 holds the rows of feature i of all the
+ * members one after the other, and so do b1 and W2, so one pass
+ * over the nonzeros of an example serves every member. Each member
+ * has its own output unit, and the output of the ensemble is the
+ * average of theirs.
+ */
 typedef struct nnet_t{
-    float** W1; /* first layer weights */
+    float** W1; /* first layer weights, NULL if they are stored as bf16 */
+    uint16_t** H1; /* first layer weights in bf16, NULL if they are floats */
+    int precision; /* PRECISION_FLOAT or PRECISION_BF16 */
     float* b1; /* first layer biases  */
-    float* a1; /* inputs to activation function of the hidden units */
-    float* x1; /* outputs of activation function of the hidden units */
-    float* g1; /* respective derivatives  */
-    float* d1; /* error in first layer */
     float* W2; /* second layer weights */
-    float b2; /* second layer bias */
-    float a2; /* input to activation function of the output unit */
-    float x2; /* output of activation function of the output unit  */
-    float g2; /* respective derivative  */
-    float d2; /* error in second layer */
+    float* b2; /* second layer bias of each member */
     float eta; /* learning rate */
     int inputs;
-    int hidden;
+    int hidden; /* of all members together */
+    int members; /* networks in the ensemble, 1 for a single network */
+    int hashbits; /* if nonzero inputs are hashed into 2^hashbits rows */
+    int hashsign; /* whether hashing also flips the sign of some inputs */
+    int* dict; /* feature id of each input, NULL if inputs are the feature ids */
+    int* order; /* inputs by increasing feature id, NULL if dict is increasing */
+    float l2; /* weight decay */
+    float l1; /* shrinkage towards zero */
+    long step; /* number of examples trained on, for regularization */
+    long* last; /* step each row of W1 (and W2 last) was regularized up to, NULL if no regularization */
+    float* decay; /* powers of the decay factor, see regularize() */
+    int batch; /* number of examples per training step */
+    int optimizer; /* OPT_SGD, OPT_ADAGRAD or OPT_RMSPROP */
+    float* accum; /* squared gradients of each row of W1, then b1 and W2, NULL for OPT_SGD */
+    void* map; /* mapped file holding the weights, NULL if they are malloc'd */
+    size_t maplen; /* length of the mapping */
 }nnet_t;
 
+/* Working memory for presenting one example to a network.
+ * Every thread that trains or evaluates a network needs its
+ * own scratch so that the weights are the only shared state.
+ */
+typedef struct scratch_t{
+    float* a1; /* inputs to activation function of the hidden units */
+    float* x1; /* outputs of activation function of the hidden units */
+    float* g1; /* respective derivatives  */
+    float* d1; /* error in first layer */
+    float* a2; /* input to activation function of the output unit of each member */
+    float* x2; /* output of activation function of the output unit of each member */
+    float* g2; /* respective derivatives  */
+    float* d2; /* errors in second layer */
+    float out; /* output of the network, the average of the members */
+    int shared; /* whether other threads train the same network */
+    struct batch_t* batch; /* buffers for mini-batches, allocated on first use */
+    float* rates; /* learning rate of each nonzero, for adaptive optimizers */
+    int nrates; /* nonzeros rates can hold */
+    uint32_t seed; /* state of the stochastic rounding of bf16 weights */
+}scratch_t;
+
 void createnet(nnet_t* n, dataset_t* d, int hid, float rate);
+void createnet_r(nnet_t* n, dataset_t* d, int hid, int members, float rate, unsigned int seed);
 
 void destroynet(nnet_t* n);
+void copynet(nnet_t* dst, nnet_t* src);
+void quantizenet(nnet_t* n, int precision);
 
 void savenet(const char* name, nnet_t* n);
+size_t packnet(nnet_t* n, char** image);
+void writenet(const char* name, const char* image, size_t len);
 void loadnet(const char* name, nnet_t* n);
+void mapnet(const char* name, nnet_t* n);
+int trymapnet(const char* name, nnet_t* n);
+
+void createscratch(nnet_t* n, scratch_t* s);
+void destroyscratch(scratch_t* s);
+
+void regularize(nnet_t* n, float l2, float l1);
+void adaptnet(nnet_t* n, int optimizer);
+void flushnet(nnet_t* n);
 
 void activation(float* p, float* f, float* g, int n);
 
-void train(nnet_t* n, sparse_t* v, int target);
+void train(nnet_t* n, scratch_t* s, sparse_t* v, int target);
+
+void trainbatch(nnet_t* n, scratch_t* s, dataset_t* d, int* ex, int count);
 
-float value(nnet_t* n, sparse_t* v);
+float value(nnet_t* n, scratch_t* s, sparse_t* v);
 
 void clipvectors(int inputs, sparse_t* v, int len);
 
-void trainnet(nnet_t* n, dataset_t* d, int *perm);
+void prepvectors(nnet_t* n, sparse_t* v, int len);
+
+void trainnet(nnet_t* n, dataset_t* d, int *perm, float *p, int threads);
+void trainpart(nnet_t* n, dataset_t* d, int *perm, int count, float *p, int threads);
 
-void testnet(nnet_t* n, dataset_t* d, float *p);
+void testnet(nnet_t* n, dataset_t* d, float *p, int threads);
 #endif /* NNET_H */
@@ -0,0 +1,413 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Scores examples sent over a socket. Every connection has  *
+ *              a thread that reads lines and queues them; worker threads *
+ *              take whatever is queued, up to a batch, and score it.     *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "dataset.h"
+#include "nnet.h"
+#include "server.h"
+#include "sockets.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of recent latencies the percentiles are computed from */
+#define LATENCIES 65536
+
+/* A loaded network. The server holds one reference to the current
+ * model and every batch being scored holds another, so a replaced
+ * model is released when the last batch that uses it is done.
+ */
+typedef struct model_t{
+    nnet_t n;
+    int refs;
+}model_t;
+
+typedef struct conn_t{
+    int fd;
+    int pending; /* requests of this connection not scored yet */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct server_t* srv;
+}conn_t;
+
+typedef struct request_t{
+    sparse_t v;
+    float score;
+    double start; /* when the request was queued */
+    conn_t* conn;
+    struct request_t* next;
+}request_t;
+
+typedef struct server_t{
+    const char* name; /* model file, read again on reload */
+    model_t* model;
+    pthread_mutex_t modellock;
+    request_t* head; /* queue of requests to score */
+    request_t* tail;
+    pthread_mutex_t queuelock;
+    pthread_cond_t queued;
+    int maxbatch;
+    float* latency; /* ring of the last LATENCIES latencies, in microseconds */
+    long count; /* requests scored so far */
+    pthread_mutex_t statlock;
+}server_t;
+
+static double now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec+1e-9*t.tv_nsec;
+}
+
+static model_t* acquire(server_t* srv){
+    model_t* m;
+    pthread_mutex_lock(&srv->modellock);
+    m=srv->model;
+    m->refs+=1;
+    pthread_mutex_unlock(&srv->modellock);
+    return m;
+}
+
+static void release(server_t* srv, model_t* m){
+    int refs;
+    pthread_mutex_lock(&srv->modellock);
+    refs=--m->refs;
+    pthread_mutex_unlock(&srv->modellock);
+    if(refs==0){
+        destroynet(&m->n);
+        free(m);
+    }
+}
+
+/* Maps the model file again and makes it the current model.
+ * Batches that already hold the old one finish with it. The
+ * file should be replaced by a rename, as savenet() does, so
+ * that it is never seen half written. If the file cannot be
+ * loaded the old model stays, and 0 is returned.
+ */
+static int reload(server_t* srv){
+    model_t *m,*old;
+    m=malloc(sizeof(model_t));
+    if(!trymapnet(srv->name,&m->n)){
+        free(m);
+        return 0;
+    }
+    m->refs=1;
+    pthread_mutex_lock(&srv->modellock);
+    old=srv->model;
+    srv->model=m;
+    pthread_mutex_unlock(&srv->modellock);
+    if(old!=NULL)
+        release(srv,old);
+    fprintf(stderr,"Loaded %s: %d inputs, %d hidden units\n",srv->name,m->n.inputs,m->n.hidden);
+    return 1;
+}
+
+static int compare(const void* a, const void* b){
+    float x=*(const float*)a;
+    float y=*(const float*)b;
+    return (x>y)-(x<y);
+}
+
+/* Writes the number of requests and the median and 99th
+ * percentile of the recent latencies to buf.
+ */
+static int stats(server_t* srv, char* buf, size_t size){
+    float* v;
+    long n;
+    int len;
+    pthread_mutex_lock(&srv->statlock);
+    n = srv->count<LATENCIES ? srv->count : LATENCIES;
+    v=malloc(sizeof(float)*(n+1));
+    memcpy(v,srv->latency,sizeof(float)*n);
+    len=snprintf(buf,size,"requests %ld ",srv->count);
+    pthread_mutex_unlock(&srv->statlock);
+    qsort(v,n,sizeof(float),compare);
+    if(n==0)
+        v[0]=0;
+    len+=snprintf(buf+len,size-len,"p50 %.1fus p99 %.1fus\n",v[n/2],v[n*99/100]);
+    free(v);
+    return len;
+}
+
+/* A worker thread: scores batches of queued requests */
+static void* worker(void* arg){
+    server_t* srv=arg;
+    request_t *batch,*r,*next;
+    scratch_t s;
+    model_t* m;
+    conn_t* conn;
+    double t;
+    int i,hidden=0,members=0;
+
+    for(;;){
+        pthread_mutex_lock(&srv->queuelock);
+        while(srv->head==NULL)
+            pthread_cond_wait(&srv->queued,&srv->queuelock);
+        batch=srv->head;
+        for(r=batch, i=1; r->next!=NULL && i<srv->maxbatch; r=r->next, i++)
+            ;
+        srv->head=r->next;
+        if(srv->head==NULL)
+            srv->tail=NULL;
+        r->next=NULL;
+        pthread_mutex_unlock(&srv->queuelock);
+
+        m=acquire(srv);
+        /* The scratch is sized by both, and a reload may change either */
+        if(m->n.hidden!=hidden || m->n.members!=members){
+            if(hidden>0)
+                destroyscratch(&s);
+            createscratch(&m->n,&s);
+            hidden=m->n.hidden;
+            members=m->n.members;
+        }
+        for(r=batch; r!=NULL; r=r->next){
+            prepvectors(&m->n,&r->v,1);
+            r->score=value(&m->n,&s,&r->v);
+        }
+        release(srv,m);
+
+        t=now();
+        pthread_mutex_lock(&srv->statlock);
+        for(r=batch; r!=NULL; r=r->next)
+            srv->latency[srv->count++%LATENCIES]=1e6*(t-r->start);
+        pthread_mutex_unlock(&srv->statlock);
+        /* The connection frees the requests once all are scored */
+        for(r=batch; r!=NULL; r=next){
+            next=r->next;
+            conn=r->conn;
+            pthread_mutex_lock(&conn->lock);
+            if(--conn->pending==0)
+                pthread_cond_signal(&conn->done);
+            pthread_mutex_unlock(&conn->lock);
+        }
+    }
+    return NULL;
+}
+
+static int sendall(int fd, const char* p, size_t len){
+    ssize_t r;
+    while(len>0){
+        r=send(fd,p,len,MSG_NOSIGNAL);
+        if(r<0 && errno==EINTR)
+            continue;
+        if(r<=0)
+            return 0;
+        p+=r;
+        len-=r;
+    }
+    return 1;
+}
+
+/* Queues the count requests in reqs, waits until they are scored
+ * and sends the scores back in order, one per line.
+ */
+static int flush(conn_t* conn, request_t** reqs, int count){
+    server_t* srv=conn->srv;
+    char* out;
+    int i,len,ok;
+
+    if(count==0)
+        return 1;
+    conn->pending=count;
+    for(i=0; i<count; i++){
+        reqs[i]->conn=conn;
+        reqs[i]->next = i+1<count ? reqs[i+1] : NULL;
+    }
+    pthread_mutex_lock(&srv->queuelock);
+    if(srv->tail==NULL)
+        srv->head=reqs[0];
+    else
+        srv->tail->next=reqs[0];
+    srv->tail=reqs[count-1];
+    pthread_cond_broadcast(&srv->queued);
+    pthread_mutex_unlock(&srv->queuelock);
+
+    pthread_mutex_lock(&conn->lock);
+    while(conn->pending>0)
+        pthread_cond_wait(&conn->done,&conn->lock);
+    pthread_mutex_unlock(&conn->lock);
+
+    out=malloc(16*count);
+    len=0;
+    for(i=0; i<count; i++){
+        len+=sprintf(out+len,"%f\n",reqs[i]->score);
+        free(reqs[i]->v.idx);
+        free(reqs[i]->v.x);
+        free(reqs[i]);
+    }
+    ok=sendall(conn->fd,out,len);
+    free(out);
+    return ok;
+}
+
+/* Handles one line: a command, or an example that is added to
+ * the requests of the current read. Commands first flush the
+ * requests before them so that replies stay in order.
+ */
+static int line(conn_t* conn, const char* p, const char* end, request_t*** reqs, int* count, int* cap){
+    char buf[128];
+    request_t* r;
+    int target,len;
+
+    while(end>p && (end[-1]=='\r' || end[-1]==' '))
+        end--;
+    if((end-p==5 && memcmp(p,"stats",5)==0) || (end-p==6 && memcmp(p,"reload",6)==0)){
+        if(!flush(conn,*reqs,*count))
+            return 0;
+        *count=0;
+        if(*p=='r'){
+            if(reload(conn->srv))
+                len=sprintf(buf,"reloaded\n");
+            else
+                len=sprintf(buf,"error could not load %.64s\n",conn->srv->name);
+        }
+        else
+            len=stats(conn->srv,buf,sizeof(buf));
+        return sendall(conn->fd,buf,len);
+    }
+    r=malloc(sizeof(request_t));
+    r->v.idx=malloc(sizeof(int)*((end-p)/2+1));
+    r->v.x=malloc(sizeof(float)*((end-p)/2+1));
+    if(!parseExample(p,end,INT_MAX,&r->v,&target))
+        /* Blank lines get a score too, so replies match lines */
+        r->v.nz=0;
+    r->start=now();
+    if(*count==*cap){
+        *cap = *cap ? 2**cap : 64;
+        *reqs=realloc(*reqs,sizeof(request_t*)**cap);
+    }
+    (*reqs)[(*count)++]=r;
+    return 1;
+}
+
+/* A connection thread: reads whatever the client has sent,
+ * queues all complete lines at once and replies to them.
+ */
+static void* connection(void* arg){
+    conn_t* conn=arg;
+    request_t** reqs=NULL;
+    char *buf,*p,*eol;
+    size_t size=65536,len=0;
+    ssize_t r;
+    int count=0,cap=0,ok=1;
+
+    buf=malloc(size);
+    while(ok){
+        if(len==size){
+            size*=2;
+            buf=realloc(buf,size);
+        }
+        r=recv(conn->fd,buf+len,size-len,0);
+        if(r<0 && errno==EINTR)
+            continue;
+        if(r<=0){
+            /* A last line without a newline */
+            if(len>0)
+                ok=line(conn,buf,buf+len,&reqs,&count,&cap) && flush(conn,reqs,count);
+            break;
+        }
+        len+=r;
+        for(p=buf; ok && (eol=memchr(p,'\n',buf+len-p))!=NULL; p=eol+1)
+            ok=line(conn,p,eol,&reqs,&count,&cap);
+        if(ok)
+            ok=flush(conn,reqs,count);
+        count=0;
+        len-=p-buf;
+        memmove(buf,p,len);
+    }
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->done);
+    free(conn);
+    free(reqs);
+    free(buf);
+    return NULL;
+}
+
+/* Reloads the model whenever the process gets SIGHUP */
+static void* hangup(void* arg){
+    server_t* srv=arg;
+    sigset_t set;
+    int sig;
+    sigemptyset(&set);
+    sigaddset(&set,SIGHUP);
+    for(;;){
+        if(sigwait(&set,&sig)==0)
+            reload(srv);
+    }
+    return NULL;
+}
+
+/* Scores examples sent to address, unix:path or host:port, with
+ * the network in the file model. Each line a client sends is an
+ * example in the format of the data files and gets one line back
+ * with its score. The lines stats and reload get the latency
+ * percentiles and reload the model. Never returns.
+ */
+void serve(const char* address, const char* model, int threads, int maxbatch){
+    server_t srv;
+    conn_t* conn;
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t set;
+    int s,fd,i;
+
+    memset(&srv,0,sizeof(srv));
+    srv.name=model;
+    srv.maxbatch=maxbatch;
+    srv.latency=malloc(sizeof(float)*LATENCIES);
+    pthread_mutex_init(&srv.modellock,NULL);
+    pthread_mutex_init(&srv.queuelock,NULL);
+    pthread_mutex_init(&srv.statlock,NULL);
+    pthread_cond_init(&srv.queued,NULL);
+    if(!reload(&srv))
+        exit(1);
+
+    /* Only the hangup thread takes SIGHUP */
+    sigemptyset(&set);
+    sigaddset(&set,SIGHUP);
+    pthread_sigmask(SIG_BLOCK,&set,NULL);
+    signal(SIGPIPE,SIG_IGN);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    pthread_create(&tid,&attr,hangup,&srv);
+    for(i=0; i<threads; i++)
+        pthread_create(&tid,&attr,worker,&srv);
+
+    s=listensocket(address,SOMAXCONN);
+    if(s<0)
+        exit(1);
+    fprintf(stderr,"Listening on %s\n",address);
+    for(;;){
+        fd=accept(s,NULL,NULL);
+        if(fd<0){
+            if(errno==EINTR || errno==ECONNABORTED)
+                continue;
+            perror(address);
+            exit(1);
+        }
+        nodelay(fd);
+        conn=malloc(sizeof(conn_t));
+        conn->fd=fd;
+        conn->pending=0;
+        conn->srv=&srv;
+        pthread_mutex_init(&conn->lock,NULL);
+        pthread_cond_init(&conn->done,NULL);
+        pthread_create(&tid,&attr,connection,conn);
+    }
+}
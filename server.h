@@ -0,0 +1,14 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Declarations for scoring examples sent over a socket.      *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+void serve(const char* address, const char* model, int threads, int maxbatch);
+
+#endif /* SERVER_H */
@@ -0,0 +1,117 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Helpers for stream sockets on Unix paths or TCP ports.     *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "sockets.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Resolves an address of the form unix:path or host:port.
+ * Listening sockets are bound to the address of host, or to
+ * every interface when host is empty, as in :port.
+ */
+static struct addrinfo* resolve(const char* address, int listening){
+    struct addrinfo hints, *res;
+    struct sockaddr_un* sun;
+    char host[256];
+    const char* port;
+    size_t len;
+
+    if(strncmp(address,"unix:",5)==0){
+        if(strlen(address+5)>=sizeof(sun->sun_path)){
+            fprintf(stderr,"Socket path %s is too long\n",address+5);
+            return NULL;
+        }
+        res=calloc(1,sizeof(*res)+sizeof(*sun));
+        sun=(struct sockaddr_un*)(res+1);
+        sun->sun_family=AF_UNIX;
+        strcpy(sun->sun_path,address+5);
+        res->ai_family=AF_UNIX;
+        res->ai_socktype=SOCK_STREAM;
+        res->ai_addr=(struct sockaddr*)sun;
+        res->ai_addrlen=sizeof(*sun);
+        return res;
+    }
+    port=strrchr(address,':');
+    if(port==NULL || (len=port-address)>=sizeof(host)){
+        fprintf(stderr,"Address %s is neither unix:path nor host:port\n",address);
+        return NULL;
+    }
+    memcpy(host,address,len);
+    host[len]='\0';
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    hints.ai_flags=listening ? AI_PASSIVE : 0;
+    if(getaddrinfo(len==0 ? NULL : host,port+1,&hints,&res)!=0){
+        fprintf(stderr,"Could not resolve %s\n",address);
+        return NULL;
+    }
+    return res;
+}
+
+static void release(struct addrinfo* a){
+    if(a->ai_family==AF_UNIX)
+        free(a);
+    else
+        freeaddrinfo(a);
+}
+
+/* Sends small messages at once. Has no effect on Unix sockets. */
+void nodelay(int fd){
+    int one=1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+}
+
+/* Listens at address. An old Unix socket file there is removed. */
+int listensocket(const char* address, int backlog){
+    struct addrinfo* a=resolve(address,1);
+    int one=1;
+    int s;
+
+    if(a==NULL)
+        return -1;
+    s=socket(a->ai_family,a->ai_socktype,0);
+    if(s>=0){
+        if(a->ai_family==AF_UNIX)
+            unlink(((struct sockaddr_un*)a->ai_addr)->sun_path);
+        else
+            setsockopt(s,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+        if(bind(s,a->ai_addr,a->ai_addrlen)!=0 || listen(s,backlog)!=0){
+            perror(address);
+            close(s);
+            s=-1;
+        }
+    }
+    release(a);
+    return s;
+}
+
+/* Connects to address once, without retrying */
+int connectsocket(const char* address){
+    struct addrinfo* a=resolve(address,0);
+    int fd;
+
+    if(a==NULL)
+        return -1;
+    fd=socket(a->ai_family,a->ai_socktype,0);
+    if(fd>=0 && connect(fd,a->ai_addr,a->ai_addrlen)!=0){
+        close(fd);
+        fd=-1;
+    }
+    if(fd>=0)
+        nodelay(fd);
+    release(a);
+    return fd;
+}
@@ -0,0 +1,19 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Declarations of helpers for stream sockets.                *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#ifndef SOCKETS_H
+#define SOCKETS_H
+
+/* Addresses are either unix:path for a Unix domain socket or
+ * host:port for TCP. Both functions return a socket or -1.
+ */
+int listensocket(const char* address, int backlog);
+int connectsocket(const char* address);
+void nodelay(int fd);
+
+#endif /* SOCKETS_H */
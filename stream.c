@@ -0,0 +1,160 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Training from a file that does not fit in memory.          *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "dataset.h"
+#include "nnet.h"
+#include "stream.h"
+#include "telemetry.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Examples read ahead by the reader thread */
+#define QUEUELEN 4096
+
+typedef struct item_t{
+    sparse_t v;
+    int target;
+}item_t;
+
+/* A bounded queue between the reader thread and the trainer.
+ * The reader pushes a NULL item at the end of the file.
+ */
+typedef struct queue_t{
+    item_t* slot[QUEUELEN];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+    /* what the reader needs */
+    const char* name;
+    int maxline;
+    nnet_t* n;
+}queue_t;
+
+static void push(queue_t* q, item_t* it){
+    pthread_mutex_lock(&q->lock);
+    while(q->count==QUEUELEN)
+        pthread_cond_wait(&q->notfull,&q->lock);
+    q->slot[(q->head+q->count)%QUEUELEN]=it;
+    q->count+=1;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static item_t* pop(queue_t* q){
+    item_t* it;
+    pthread_mutex_lock(&q->lock);
+    while(q->count==0)
+        pthread_cond_wait(&q->notempty,&q->lock);
+    it=q->slot[q->head];
+    q->head=(q->head+1)%QUEUELEN;
+    q->count-=1;
+    pthread_cond_signal(&q->notfull);
+    pthread_mutex_unlock(&q->lock);
+    return it;
+}
+
+static void freeitem(item_t* it){
+    free(it->v.x);
+    free(it->v.idx);
+    free(it);
+}
+
+/* Reads the file sequentially and hands out copies of its examples */
+static void* reader(void* arg){
+    queue_t* q=arg;
+    sparse_t s;
+    item_t* it;
+    int target;
+    FILE* fp;
+    TELEMETRY_TIMER(tick);
+
+    fp=fopen(q->name,"r");
+    if(fp==NULL){
+        fprintf(stderr,"Could not open file %s\n",q->name);
+        exit(1);
+    }
+    s.x=malloc(q->maxline*sizeof(float));
+    s.idx=malloc(q->maxline*sizeof(int));
+    while(readExample(fp, q->maxline, INT_MAX, &s, &target)){
+        prepvectors(q->n, &s, 1);
+        TELEMETRY_LAP(TM_PARSE, tick);
+        it=malloc(sizeof(item_t));
+        it->target=target;
+        it->v.nz=s.nz;
+        it->v.x=malloc(s.nz*sizeof(float));
+        it->v.idx=malloc(s.nz*sizeof(int));
+        memcpy(it->v.x,s.x,s.nz*sizeof(float));
+        memcpy(it->v.idx,s.idx,s.nz*sizeof(int));
+        push(q,it);
+        /* waiting for room in the queue is not parsing */
+        TELEMETRY_RESTART(tick);
+    }
+    push(q,NULL);
+    TELEMETRY_FLUSH();
+    free(s.x);
+    free(s.idx);
+    fclose(fp);
+    return NULL;
+}
+
+/* Run one epoch of training over the examples in file name
+ * without loading it into memory. A reader thread parses the
+ * file while the network trains. The examples pass through a
+ * shuffle buffer of bufsize slots: once the buffer is full, each
+ * new example replaces a randomly chosen one, which is trained
+ * on. Memory is bounded by the buffer and the read-ahead queue.
+ */
+void trainstream(nnet_t* n, const char* name, int maxline, int bufsize){
+    queue_t q;
+    pthread_t tid;
+    scratch_t s;
+    item_t** buf;
+    item_t* it;
+    int count,r;
+
+    memset(&q,0,sizeof(q));
+    pthread_mutex_init(&q.lock,NULL);
+    pthread_cond_init(&q.notempty,NULL);
+    pthread_cond_init(&q.notfull,NULL);
+    q.name=name;
+    q.maxline=maxline;
+    q.n=n;
+    pthread_create(&tid,NULL,reader,&q);
+
+    createscratch(n,&s);
+    buf=malloc(bufsize*sizeof(item_t*));
+    count=0;
+    while((it=pop(&q))!=NULL){
+        if(count<bufsize){
+            buf[count++]=it;
+            continue;
+        }
+        r=rand()%bufsize;
+        train(n, &s, &buf[r]->v, buf[r]->target);
+        freeitem(buf[r]);
+        buf[r]=it;
+    }
+    /* Drain what is left in random order */
+    while(count>0){
+        r=rand()%count;
+        train(n, &s, &buf[r]->v, buf[r]->target);
+        freeitem(buf[r]);
+        buf[r]=buf[--count];
+    }
+    pthread_join(tid,NULL);
+    free(buf);
+    destroyscratch(&s);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.notempty);
+    pthread_cond_destroy(&q.notfull);
+}
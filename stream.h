@@ -0,0 +1,16 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Declarations for training from a stream of examples.       *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "nnet.h"
+
+void trainstream(nnet_t* n, const char* name, int maxline, int bufsize);
+
+#endif /* STREAM_H */
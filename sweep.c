@@ -0,0 +1,350 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Trains a grid of networks at once on one copy of the data. *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "dataset.h"
+#include "metrics.h"
+#include "nnet.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Most values a list option can take */
+#define MAXLIST 64
+
+/* One network of the grid, trained on one fold */
+typedef struct job_t{
+    int config; /* index of its hidden units, rate and seed in the grid */
+    int hidden;
+    float rate;
+    unsigned int seed;
+    int fold; /* part of the training set held out, -1 for none */
+    metrics_t best; /* validation metrics at the epoch of the best AUC */
+    int epoch;
+}job_t;
+
+/* What the threads share. The data sets are only read. */
+typedef struct sweep_t{
+    dataset_t* train;
+    dataset_t* stop; /* NULL with folds */
+    int folds;
+    int epochs;
+    int period;
+    float l2,l1;
+    job_t* job;
+    int njobs;
+    int next; /* first job not yet handed out */
+    /* the best networks of the whole grid, without folds */
+    best_t best;
+    pthread_mutex_t lock;
+    pthread_mutex_t savelock; /* one thread writes networks at a time */
+}sweep_t;
+
+/* Generate and store a permutation of a in a, from the state *seed */
+static void shuffle(int* a, int n, unsigned int* seed){
+    int r,i;
+    int t;
+    for(i=n-1; i>0; i--){
+        r=rand_r(seed)%(i+1);
+        t=a[r]; a[r]=a[i]; a[i]=t;
+    }
+}
+
+/* Parses a comma separated list of numbers into v, returns how many */
+static int parselist(const char* s, double* v){
+    char* end;
+    int n=0;
+    while(n<MAXLIST){
+        v[n]=strtod(s,&end);
+        if(end==s)
+            break;
+        n+=1;
+        if(*end!=',')
+            break;
+        s=end+1;
+    }
+    return n;
+}
+
+/* Saves n to the files of the metrics in which it beats every
+ * network of the grid so far. The files are written outside of
+ * w->lock, so the other threads go on meanwhile. A network that
+ * another thread beats before it is written is not written, so
+ * every file ends up with the best one.
+ */
+static void keepbest(sweep_t* w, nnet_t* n, metrics_t* m){
+    long seen[3];
+    char* image=NULL;
+    size_t len=0;
+    int i,improved,current;
+
+    pthread_mutex_lock(&w->lock);
+    improved=improvebest(&w->best, m, seen);
+    if(improved)
+        len=packnet(n,&image);
+    pthread_mutex_unlock(&w->lock);
+    if(!improved)
+        return;
+    pthread_mutex_lock(&w->savelock);
+    for(i=0; i<3; i++){
+        if(!(improved&(1<<i)))
+            continue;
+        pthread_mutex_lock(&w->lock);
+        current = w->best.seen[i]==seen[i];
+        pthread_mutex_unlock(&w->lock);
+        if(current)
+            writenet(w->best.file[i],image,len);
+    }
+    pthread_mutex_unlock(&w->savelock);
+    free(image);
+}
+
+/* Trains the network of job j and records its best epoch. The
+ * held out fold is a view into the training set, like the shard
+ * of a worker in nnlearn, so it costs no memory.
+ */
+static void runjob(sweep_t* w, job_t* j){
+    nnet_t n;
+    dataset_t valid;
+    evaluator_t e;
+    metrics_t m;
+    unsigned int seed=j->seed;
+    float* p;
+    int* perm;
+    int i,count,begin,end;
+
+    if(w->folds>1){
+        begin=(int)((long)w->train->nex*j->fold/w->folds);
+        end=(int)((long)w->train->nex*(j->fold+1)/w->folds);
+        valid=*w->train;
+        valid.example+=begin;
+        valid.target+=begin;
+        valid.nex=end-begin;
+        valid.map=NULL;
+    }
+    else{
+        begin=end=w->train->nex;
+        valid=*w->stop;
+    }
+    count=w->train->nex-(end-begin);
+    perm=malloc(sizeof(int)*(count>0 ? count : 1));
+    for(i=0; i<begin; i++)
+        perm[i]=i;
+    for(i=end; i<w->train->nex; i++)
+        perm[i-end+begin]=i;
+    p=malloc(sizeof(float)*(valid.nex>0 ? valid.nex : 1));
+
+    createnet_r(&n, w->train, j->hidden, 1, j->rate/count, seed);
+    if(w->l2>0 || w->l1>0)
+        regularize(&n, w->l2, w->l1);
+    initevaluator(&e, 0);
+    j->best.acc=0;
+    j->best.rms=2;
+    j->best.auc=0;
+    j->epoch=-1;
+    for(i=0; i<w->epochs; i++){
+        shuffle(perm, count, &seed);
+        trainpart(&n, w->train, perm, count, NULL, 1);
+        if(i % w->period == 0 || i==w->epochs-1){
+            flushnet(&n);
+            testnet(&n, &valid, p, 1);
+            evaluate(&e, p, valid.target, valid.nex, &m);
+            if(j->epoch<0 || m.auc>j->best.auc){
+                j->best=m;
+                j->epoch=i;
+            }
+            if(w->folds<=1)
+                keepbest(w, &n, &m);
+        }
+    }
+    destroyevaluator(&e);
+    destroynet(&n);
+    free(p);
+    free(perm);
+}
+
+/* A thread of the pool: runs jobs until there are none left */
+static void* worker(void* arg){
+    sweep_t* w=arg;
+    job_t* j;
+    int i;
+    while((i=__sync_fetch_and_add(&w->next,1)) < w->njobs){
+        j=&w->job[i];
+        runjob(w, j);
+        pthread_mutex_lock(&w->lock);
+        printf("hidden %d rate %g seed %u fold %d epoch %d sacc %.5f srms %.5f sauc %.5f\n",
+            j->hidden, j->rate, j->seed, j->fold, j->epoch, j->best.acc, j->best.rms, j->best.auc);
+        fflush(stdout);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+/* Bigger networks first, so the pool does not end on one of them */
+static int cmpjob(const void* a, const void* b){
+    const job_t* x=a;
+    const job_t* y=b;
+    if(x->hidden!=y->hidden)
+        return x->hidden>y->hidden ? -1 : 1;
+    if(x->config!=y->config)
+        return x->config<y->config ? -1 : 1;
+    return x->fold<y->fold ? -1 : x->fold>y->fold;
+}
+
+/* A row of the results table: the mean over the folds of a configuration */
+typedef struct row_t{
+    int hidden;
+    float rate;
+    unsigned int seed;
+    double acc,rms,auc,epoch;
+}row_t;
+
+static int cmprow(const void* a, const void* b){
+    const row_t* x=a;
+    const row_t* y=b;
+    return x->auc>y->auc ? -1 : x->auc<y->auc;
+}
+
+int main(int argc, char* argv[]){
+    dataset_t train,stop;
+    sweep_t w;
+    row_t* rows;
+    pthread_t* tid;
+    double hidden[MAXLIST],rate[MAXLIST],seed[MAXLIST];
+    int nhidden,nrate,nseed,nconfig,folds=1;
+    int threads=1;
+    int option;
+    int a,b,c,f,i,k;
+    char* prefix;
+
+    const char* help="Usage: %s [options] trainingset validationset model\n\
+       %s -k folds [options] trainingset\nAvailable options:\n\
+            -e <int>  : number of epochs (default: 100)\n\
+            -h <list> : comma separated numbers of hidden units (default: 16)\n\
+            -k <int>  : cross validate on so many contiguous parts of the training set\n\
+            -l <float>: L2 regularization (default: 0)\n\
+            -L <float>: L1 regularization (default: 0)\n\
+            -p <int>  : evaluate every so many epochs (default: 1)\n\
+            -r <list> : comma separated learning rates (default: 0.05)\n\
+            -s <list> : comma separated random seeds (default: 1)\n\
+            -t <int>  : number of networks trained at the same time (default: 1)\n";
+
+    hidden[0]=16; nhidden=1;
+    rate[0]=0.05; nrate=1;
+    seed[0]=1; nseed=1;
+    memset(&w,0,sizeof(w));
+    w.epochs=100;
+    w.period=1;
+    while((option=getopt(argc,argv,"e:h:k:l:L:p:r:s:t:"))!=EOF){
+        switch(option){
+            case 'e': w.epochs=atoi(optarg); break;
+            case 'h': nhidden=parselist(optarg,hidden); break;
+            case 'k': folds=atoi(optarg); break;
+            case 'l': w.l2=atof(optarg); break;
+            case 'L': w.l1=atof(optarg); break;
+            case 'p': w.period=atoi(optarg); break;
+            case 'r': nrate=parselist(optarg,rate); break;
+            case 's': nseed=parselist(optarg,seed); break;
+            case 't': threads=atoi(optarg); break;
+            case '?': fprintf(stderr,help,argv[0],argv[0]); exit(1); break;
+        }
+    }
+    if(argv[optind]==0 || (folds<=1 && (argv[optind+1]==0 || argv[optind+2]==0))){
+        fprintf(stderr,help,argv[0],argv[0]);
+        exit(1);
+    }
+    if(nhidden<1 || nrate<1 || nseed<1 || w.epochs<1 || w.period<1 || threads<1){
+        fprintf(stderr,"Every list needs at least one value and every count must be positive\n");
+        exit(1);
+    }
+    for(i=0; i<nhidden; i++){
+        if(hidden[i]<1){
+            fprintf(stderr,"The number of hidden units must be at least 1\n");
+            exit(1);
+        }
+    }
+
+    /* The only copy of the data, shared by every network */
+    loadData(argv[optind], &train);
+    if(folds>1){
+        if(folds>train.nex){
+            fprintf(stderr,"There are fewer examples than folds\n");
+            exit(1);
+        }
+        w.stop=NULL;
+    }
+    else{
+        loadData(argv[optind+1], &stop);
+        writableData(&stop);
+        clipvectors(train.nfeat, stop.example, stop.nex);
+        w.stop=&stop;
+        prefix=argv[optind+2];
+        initbest(&w.best, prefix);
+    }
+    w.train=&train;
+    w.folds=folds;
+    pthread_mutex_init(&w.lock,NULL);
+    pthread_mutex_init(&w.savelock,NULL);
+
+    nconfig=nhidden*nrate*nseed;
+    w.njobs=nconfig*folds;
+    w.job=malloc(sizeof(job_t)*w.njobs);
+    k=0;
+    for(a=0; a<nhidden; a++){
+        for(b=0; b<nrate; b++){
+            for(c=0; c<nseed; c++){
+                for(f=0; f<folds; f++){
+                    w.job[k].config=k/folds;
+                    w.job[k].hidden=(int)hidden[a];
+                    w.job[k].rate=rate[b];
+                    w.job[k].seed=(unsigned int)seed[c];
+                    w.job[k].fold = folds>1 ? f : -1;
+                    k+=1;
+                }
+            }
+        }
+    }
+    qsort(w.job,w.njobs,sizeof(job_t),cmpjob);
+
+    if(threads>w.njobs)
+        threads=w.njobs;
+    tid=malloc(sizeof(pthread_t)*threads);
+    for(i=0; i<threads; i++)
+        pthread_create(&tid[i],NULL,worker,&w);
+    for(i=0; i<threads; i++)
+        pthread_join(tid[i],NULL);
+
+    /* Average the folds of every configuration */
+    rows=calloc(nconfig,sizeof(row_t));
+    for(i=0; i<w.njobs; i++){
+        k=w.job[i].config;
+        rows[k].hidden=w.job[i].hidden;
+        rows[k].rate=w.job[i].rate;
+        rows[k].seed=w.job[i].seed;
+        rows[k].acc+=w.job[i].best.acc/folds;
+        rows[k].rms+=w.job[i].best.rms/folds;
+        rows[k].auc+=w.job[i].best.auc/folds;
+        rows[k].epoch+=(double)w.job[i].epoch/folds;
+    }
+    qsort(rows,nconfig,sizeof(row_t),cmprow);
+    printf("%8s %12s %10s %8s %8s %8s %8s\n","hidden","rate","seed","acc","rms","auc","epoch");
+    for(i=0; i<nconfig; i++)
+        printf("%8d %12g %10u %8.5f %8.5f %8.5f %8.1f\n",rows[i].hidden,rows[i].rate,rows[i].seed,
+            rows[i].acc,rows[i].rms,rows[i].auc,rows[i].epoch);
+
+    free(rows);
+    free(tid);
+    free(w.job);
+    pthread_mutex_destroy(&w.lock);
+    pthread_mutex_destroy(&w.savelock);
+    if(folds<=1)
+        freeData(&stop);
+    freeData(&train);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Counters and timers of where training spends its time.    *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#include "telemetry.h"
+#include <string.h>
+
+__thread telemetry_t telemetrylocal;
+
+static telemetry_t total;
+
+void telemetryflush(void){
+    int i;
+    for(i=0; i<TM_TIMERS; i++)
+        __sync_fetch_and_add(&total.ns[i], telemetrylocal.ns[i]);
+    for(i=0; i<TC_COUNTERS; i++)
+        __sync_fetch_and_add(&total.count[i], telemetrylocal.count[i]);
+    memset(&telemetrylocal,0,sizeof(telemetrylocal));
+}
+
+static double perseconds(uint64_t count, uint64_t ns){
+    return ns>0 ? count*1e9/ns : 0;
+}
+
+void telemetrywrite(FILE* fp, int epoch, double seconds){
+    telemetry_t t;
+    double sec[TM_TIMERS];
+    int i;
+
+    telemetryflush();
+    /* An evaluation thread may be adding to the totals meanwhile */
+    for(i=0; i<TM_TIMERS; i++){
+        t.ns[i]=__sync_fetch_and_and(&total.ns[i], 0);
+        sec[i]=t.ns[i]*1e-9;
+    }
+    for(i=0; i<TC_COUNTERS; i++)
+        t.count[i]=__sync_fetch_and_and(&total.count[i], 0);
+    fprintf(fp,"{\"epoch\":%d,\"seconds\":%.6f,\"train_sec\":%.6f,"
+        "\"examples\":%llu,\"nnz\":%llu,"
+        "\"examples_per_sec\":%.0f,\"nnz_per_sec\":%.0f,"
+        "\"skipped\":%llu,\"skipped_fraction\":%.6f,"
+        "\"parse_sec\":%.6f,\"shuffle_sec\":%.6f,"
+        "\"forward_sec\":%.6f,\"backward_sec\":%.6f,"
+        "\"eval_sec\":%.6f,\"save_sec\":%.6f}\n",
+        epoch, seconds, sec[TM_TRAIN],
+        (unsigned long long)t.count[TC_EXAMPLES],
+        (unsigned long long)t.count[TC_NNZ],
+        perseconds(t.count[TC_EXAMPLES],t.ns[TM_TRAIN]),
+        perseconds(t.count[TC_NNZ],t.ns[TM_TRAIN]),
+        (unsigned long long)t.count[TC_SKIPPED],
+        t.count[TC_EXAMPLES]>0 ? t.count[TC_SKIPPED]/(double)t.count[TC_EXAMPLES] : 0,
+        sec[TM_PARSE], sec[TM_SHUFFLE],
+        sec[TM_FORWARD], sec[TM_BACKWARD],
+        sec[TM_EVAL], sec[TM_SAVE]);
+    fflush(fp);
+}
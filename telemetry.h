@@ -0,0 +1,78 @@
+/***************************************************************************
+ * Author: Nikos Karampatziakis <nk@cs.cornell.edu>, Copyright (C) 2008    *
+ *                                                                         *
+ * Description: Counters and timers of where training spends its time.    *
+ *                                                                         *
+ * License: See LICENSE file that comes with this distribution             *
+ ***************************************************************************/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Timers, in nanoseconds */
+#define TM_PARSE 0    /* parsing text into examples */
+#define TM_SHUFFLE 1  /* shuffling the permutation of an epoch */
+#define TM_TRAIN 2    /* wall time of the training part of an epoch */
+#define TM_FORWARD 3  /* forward passes of train() and trainbatch() */
+#define TM_BACKWARD 4 /* backward passes and weight updates */
+#define TM_EVAL 5     /* predicting and computing the metrics */
+#define TM_SAVE 6     /* serializing and writing the models */
+#define TM_TIMERS 7
+
+/* Counters */
+#define TC_EXAMPLES 0 /* examples trained on */
+#define TC_NNZ 1      /* nonzeros of those examples */
+#define TC_SKIPPED 2  /* examples past the hinge, not backpropagated */
+#define TC_COUNTERS 3
+
+typedef struct telemetry_t{
+    uint64_t ns[TM_TIMERS];
+    uint64_t count[TC_COUNTERS];
+}telemetry_t;
+
+/* Every thread adds to its own copy, without atomics or sharing
+ * cache lines, and folds it into the process total with
+ * telemetryflush() when it is done with a piece of work.
+ */
+extern __thread telemetry_t telemetrylocal;
+
+void telemetryflush(void);
+
+/* Flushes the calling thread, then writes the totals since the
+ * previous line as one line of JSON and starts them over.
+ */
+void telemetrywrite(FILE* fp, int epoch, double seconds);
+
+static inline uint64_t telemetryclock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u+ts.tv_nsec;
+}
+
+/* The hot paths use these macros, which compile to nothing
+ * unless TELEMETRY is defined (make telemetry=1). TELEMETRY_TIMER
+ * declares and starts a timer, so it goes last among the
+ * declarations of a block. TELEMETRY_LAP charges the time since
+ * the timer started, or since the previous lap, to one of TM_*,
+ * and TELEMETRY_RESTART drops that time instead.
+ */
+#ifdef TELEMETRY
+#define TELEMETRY_TIMER(t) uint64_t t=telemetryclock()
+#define TELEMETRY_LAP(timer,t) do{ uint64_t lap_=telemetryclock(); \
+    telemetrylocal.ns[timer]+=lap_-(t); (t)=lap_; }while(0)
+#define TELEMETRY_RESTART(t) ((t)=telemetryclock())
+#define TELEMETRY_COUNT(counter,k) (telemetrylocal.count[counter]+=(k))
+#define TELEMETRY_FLUSH() telemetryflush()
+#else
+#define TELEMETRY_TIMER(t)
+#define TELEMETRY_LAP(timer,t)
+#define TELEMETRY_RESTART(t)
+#define TELEMETRY_COUNT(counter,k)
+#define TELEMETRY_FLUSH()
+#endif
+
+#endif /* TELEMETRY_H */